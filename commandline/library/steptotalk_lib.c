@@ -2,6 +2,17 @@
 // steptotalk_lib.c
 // ============================================================================
 
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/time.h>
+#ifndef WIN
+#include <sys/stat.h>
+#endif
+#ifdef LINUX
+#include <dirent.h>
+#endif
+
 #include "steptotalk_lib.h"
 #include "littleWire_util.h"
 
@@ -9,41 +20,513 @@
 // FUNCTIONS
 // ============================================================================
 
-stepDevice* device_connect() {
+// One libusb context for the life of the program, see device_exit()
+static libusb_context *usbContext = NULL;
+
+// Set by the hotplug callback whenever a matching device is attached
+static volatile int deviceArrived = 0;
+
+// What to do with a reply before the callback sees it
+#define REPLY_NONE      0
+#define REPLY_KEYS      1           // GET_KEY, update Step->keys
+
+struct stt_request {
+    stepDevice *Step;
+    struct libusb_transfer *transfer;
+    stt_callback callback;
+    void *userData;
+    uint8_t reply;
+    uint8_t cancelled;
+    stt_request *next;
+};
+
+// Submitted and not completed yet, so device_close can wait them out
+static stt_request *requestsInFlight = NULL;
+
+#ifdef LINUX
+// Step-to-Talk devices as listed by sysfs, so finding one does not mean
+// reading descriptors from everything on the bus. Kept until a device
+// arrives or a cached one turns out to be gone. Without a readable sysfs,
+// in containers or chroots, devices are found by opening them instead.
+#define SYSFS_USB_DEVICES   "/sys/bus/usb/devices"
+
+typedef struct {
+    uint8_t bus;
+    uint8_t address;
+    char serial[32];
+    char path[32];                              // Directory name, e.g. 1-1.2
+    uint16_t version;                           // bcdDevice
+} sysfsEntry;
+
+static sysfsEntry *sysfsCache = NULL;           // Grows to fit every device
+static int sysfsCapacity = 0;
+static int sysfsCount = -1;                     // -1 until the bus is walked
+static int sysfsMissing = 0;                    // Last walk could not read sysfs
+#endif
+
+// ----------------------------------------------------------------------------
+
+static int usbContextInit() {
+    return usbContext != NULL ? 0 : libusb_init(&usbContext);
+}
+
+// ----------------------------------------------------------------------------
+
+// Bus and port chain in the form Linux uses for sysfs, e.g. 1-1.2
+static void devicePath(libusb_device *dev, char *path, size_t size) {
+
+    uint8_t ports[7];
+    int count = libusb_get_port_numbers(dev, ports, sizeof(ports));
+    int length = snprintf(path, size, "%u", libusb_get_bus_number(dev));
+
+    for (int i = 0; i < count && length < (int)size; i++) {
+        length += snprintf(path + length, size - length, "%c%u", i ? '.' : '-', ports[i]);
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+static int fetchCapabilities(stepDevice* Step, unsigned int timeout);
+
+// ----------------------------------------------------------------------------
+
+// Open a matching device and read what the rest of the library needs. With
+// a serial given, devices with any other serial are closed again. timeout
+// bounds each request made on the way, 0 for the default.
+static stepDevice* device_open(libusb_device *dev, const char *serial,
+        unsigned int timeout) {
+
+    struct libusb_device_descriptor desc;
+    stepDevice *Step;
+
+    // Try to get descriptor, otherwise skip
+    if (libusb_get_device_descriptor(dev, &desc) < 0) return NULL;
+
+    // Match device
+    if (desc.idVendor     != STEPTOTALK_VENDOR_ID
+        || desc.idProduct != STEPTOTALK_PRODUCT_ID) return NULL;
+
+    Step = calloc(1, sizeof(stepDevice));
+    if (Step == NULL) return NULL;
+
+    Step->version.major = (desc.bcdDevice >> 8) & 0xFF;
+    Step->version.minor = desc.bcdDevice & 0xFF;
+    devicePath(dev, Step->path, sizeof(Step->path));
+
+    if (libusb_open(dev, &Step->device) < 0) {
+        free(Step);
+        return NULL;
+    }
+
+    if (libusb_get_string_descriptor_ascii(Step->device,
+            desc.iSerialNumber, (unsigned char *)Step->serial,
+            sizeof(Step->serial)) < 0) {
+        Step->serial[0] = '\0';
+    }
+
+    if (serial != NULL && strcmp(serial, Step->serial) != 0) {
+        libusb_close(Step->device);
+        free(Step);
+        return NULL;
+    }
+
+    fetchCapabilities(Step, timeout);
+
+    Step->numKeys = Step->caps.numKeys;
+    Step->keys = calloc(Step->numKeys, sizeof(stt_keymap));
+
+    return Step;
+}
+
+// ----------------------------------------------------------------------------
+
+#ifdef LINUX
+// Read one attribute of a sysfs USB device, without the trailing newline
+static int sysfsRead(const char *device, const char *name, char *value, int size) {
+
+    char path[256];
+    snprintf(path, sizeof(path), SYSFS_USB_DEVICES "/%s/%s", device, name);
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+
+    if (fgets(value, size, file) == NULL) {
+        value[0] = '\0';
+    }
+    fclose(file);
+
+    value[strcspn(value, "\n")] = '\0';
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+
+// Fill sysfsCache with every attached Step-to-Talk device, sets
+// sysfsMissing if that cannot be done
+static void sysfsWalk() {
+
+    DIR *dir = opendir(SYSFS_USB_DEVICES);
+    struct dirent *entry;
+    char value[32];
+
+    sysfsCount = 0;
+    sysfsMissing = (dir == NULL);
+    if (dir == NULL) {
+        return;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+
+        // Interfaces are listed as bus-port:config.interface, skip them
+        if (entry->d_name[0] == '.' || strchr(entry->d_name, ':') != NULL) continue;
+
+        if (sysfsRead(entry->d_name, "idVendor", value, sizeof(value)) < 0
+            || strtol(value, NULL, 16) != STEPTOTALK_VENDOR_ID) continue;
+        if (sysfsRead(entry->d_name, "idProduct", value, sizeof(value)) < 0
+            || strtol(value, NULL, 16) != STEPTOTALK_PRODUCT_ID) continue;
+
+        if (sysfsCount == sysfsCapacity) {
+            int capacity = sysfsCapacity ? sysfsCapacity * 2 : 8;
+            sysfsEntry *grown = realloc(sysfsCache, capacity * sizeof(sysfsEntry));
+            if (grown == NULL) {
+                sysfsMissing = 1;
+                break;
+            }
+            sysfsCache = grown;
+            sysfsCapacity = capacity;
+        }
+
+        sysfsEntry *cached = &sysfsCache[sysfsCount];
+
+        if (sysfsRead(entry->d_name, "busnum", value, sizeof(value)) < 0) continue;
+        cached->bus = atoi(value);
+        if (sysfsRead(entry->d_name, "devnum", value, sizeof(value)) < 0) continue;
+        cached->address = atoi(value);
+        if (sysfsRead(entry->d_name, "bcdDevice", value, sizeof(value)) < 0) continue;
+        cached->version = strtol(value, NULL, 16);
+        if (sysfsRead(entry->d_name, "serial", cached->serial, sizeof(cached->serial)) < 0) {
+            cached->serial[0] = '\0';
+        }
+        snprintf(cached->path, sizeof(cached->path), "%.31s", entry->d_name);
+
+        sysfsCount++;
+    }
+
+    closedir(dir);
+}
+#endif
+
+// ----------------------------------------------------------------------------
+
+// Single pass over the devices present right now
+static stepDevice* device_scan(const char *serial) {
+
+    stepDevice *Step = NULL;
+    libusb_device **devs, **dev;
+    int openAll = 1;
+
+    if (libusb_get_device_list(usbContext, &devs) < 0) return NULL;
+
+#ifdef LINUX
+    // Pick devices by sysfs, only the chosen one is ever opened. A cached
+    // listing that finds nothing gets one fresh walk before giving up.
+    int fresh = 0;
+
+    for (int pass = 0; pass < 2 && Step == NULL; pass++) {
+        if (sysfsCount < 0 || pass) {
+            if (fresh) break;
+            sysfsWalk();
+            fresh = 1;
+        }
+        if (sysfsMissing) break;
+
+        for (int i = 0; i < sysfsCount && Step == NULL; i++) {
+            if (serial != NULL && strcmp(serial, sysfsCache[i].serial) != 0) continue;
+
+            for (dev = devs; *dev && Step == NULL; dev++) {
+                if (libusb_get_bus_number(*dev) == sysfsCache[i].bus
+                    && libusb_get_device_address(*dev) == sysfsCache[i].address) {
+                    Step = device_open(*dev, serial, 0);
+                }
+            }
+        }
+    }
+    openAll = sysfsMissing;
+#endif
+
+    for (dev = devs; openAll && *dev && Step == NULL; dev++) {
+        Step = device_open(*dev, serial, 0);
+    }
+
+    libusb_free_device_list(devs, 1);
+    return Step;
+}
+
+// ----------------------------------------------------------------------------
+
+static int LIBUSB_CALL device_arrived(libusb_context *ctx, libusb_device *dev,
+        libusb_hotplug_event event, void *user_data) {
+
+    // Opening from inside the callback is not allowed, scan afterwards
+    deviceArrived = 1;
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+
+stepDevice* device_connect(unsigned int timeout) {
+    return device_connect_serial(NULL, timeout);
+}
+
+// ----------------------------------------------------------------------------
+
+stepDevice* device_connect_serial(const char *serial, unsigned int timeout) {
 
     stepDevice *Step = NULL;
+    libusb_hotplug_callback_handle handle;
+
+    if (usbContextInit() < 0) return NULL;
+
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        return device_scan(serial);
+    }
+
+    // Devices already attached are reported during registration
+    deviceArrived = 0;
+    if (libusb_hotplug_register_callback(usbContext,
+            LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_ENUMERATE,
+            STEPTOTALK_VENDOR_ID, STEPTOTALK_PRODUCT_ID,
+            LIBUSB_HOTPLUG_MATCH_ANY, device_arrived, NULL, &handle) < 0) {
+        return device_scan(serial);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (Step == NULL) {
+
+        if (deviceArrived) {
+            deviceArrived = 0;
+#ifdef LINUX
+            sysfsCount = -1;
+#endif
+
+            // Freshly enumerated devices may not be ready for us yet
+            Step = device_scan(serial);
+            if (Step == NULL) {
+                delay(CONNECT_WAIT);
+#ifdef LINUX
+                sysfsCount = -1;
+#endif
+                Step = device_scan(serial);
+            }
+            continue;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long elapsed = (now.tv_sec - start.tv_sec) * 1000
+            + (now.tv_nsec - start.tv_nsec) / 1000000;
+
+        if (timeout && elapsed >= (long)timeout) {
+            break;
+        }
+
+        struct timeval tv = { 0, 100000 };
+        libusb_handle_events_timeout_completed(usbContext, &tv, NULL);
+    }
+
+    libusb_hotplug_deregister_callback(usbContext, handle);
+
+    return Step;
+}
+
+// ----------------------------------------------------------------------------
+
+// List devices by opening each one to read its serial number
+static int deviceListOpen(stt_device_info** list) {
+
+    int count = 0;
     libusb_device **devs, **dev;
+    ssize_t total = libusb_get_device_list(usbContext, &devs);
+    if (total < 0) return total;
 
-    // Initialize USB
-    if (libusb_init(NULL) < 0 || libusb_get_device_list(NULL, &devs) < 0) return NULL;
+    *list = calloc(total ? total : 1, sizeof(stt_device_info));
+    if (*list == NULL) {
+        libusb_free_device_list(devs, 1);
+        return LIBUSB_ERROR_NO_MEM;
+    }
 
     for (dev = devs; *dev; dev++) {
         struct libusb_device_descriptor desc;
+        libusb_device_handle *handle;
+
+        if (libusb_get_device_descriptor(*dev, &desc) < 0
+            || desc.idVendor  != STEPTOTALK_VENDOR_ID
+            || desc.idProduct != STEPTOTALK_PRODUCT_ID) continue;
 
-        // Try to get descriptor, otherwise skip
-        if (libusb_get_device_descriptor(*dev, &desc) < 0) continue;
+        stt_device_info *info = &(*list)[count++];
+        info->version.major = (desc.bcdDevice >> 8) & 0xFF;
+        info->version.minor = desc.bcdDevice & 0xFF;
+        info->bus = libusb_get_bus_number(*dev);
+        info->address = libusb_get_device_address(*dev);
+        devicePath(*dev, info->path, sizeof(info->path));
 
-            // Match device
-            if (desc.idVendor     == STEPTOTALK_VENDOR_ID
-                && desc.idProduct == STEPTOTALK_PRODUCT_ID) {
+        // No other way to the serial here
+        if (libusb_open(*dev, &handle) == 0) {
+            if (libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber,
+                    (unsigned char *)info->serial, sizeof(info->serial)) < 0) {
+                info->serial[0] = '\0';
+            }
+            libusb_close(handle);
+        }
+    }
+
+    libusb_free_device_list(devs, 1);
+    return count;
+}
+
+// ----------------------------------------------------------------------------
 
-                    Step = malloc(sizeof(stepDevice));
-                    Step->version.major = (desc.bcdDevice >> 8) & 0xFF;
-                    Step->version.minor = desc.bcdDevice & 0xFF;
+int device_list(stt_device_info** list) {
 
-                    if (libusb_open(*dev, &Step->device) < 0) return NULL;
+    *list = NULL;
 
-            }
+    int res = usbContextInit();
+    if (res < 0) return res;
+
+#ifdef LINUX
+    // Always a fresh walk, the caller wants what is attached now
+    sysfsWalk();
+
+    if (!sysfsMissing) {
+        *list = calloc(sysfsCount ? sysfsCount : 1, sizeof(stt_device_info));
+        if (*list == NULL) return LIBUSB_ERROR_NO_MEM;
+
+        for (int i = 0; i < sysfsCount; i++) {
+            stt_device_info *info = &(*list)[i];
+            memcpy(info->serial, sysfsCache[i].serial, sizeof(info->serial));
+            memcpy(info->path, sysfsCache[i].path, sizeof(info->path));
+            info->version.major = sysfsCache[i].version >> 8;
+            info->version.minor = sysfsCache[i].version & 0xFF;
+            info->bus = sysfsCache[i].bus;
+            info->address = sysfsCache[i].address;
+        }
+        return sysfsCount;
+    }
+#endif
+
+    return deviceListOpen(list);
+}
+
+// ----------------------------------------------------------------------------
+
+void device_list_free(stt_device_info* list) {
+    free(list);
+}
+
+// ----------------------------------------------------------------------------
+
+stepDevice* device_connect_info(const stt_device_info* info, unsigned int timeout) {
+
+    stepDevice *Step = NULL;
+    libusb_device **devs, **dev;
+
+    if (usbContextInit() < 0) return NULL;
+    if (libusb_get_device_list(usbContext, &devs) < 0) return NULL;
+
+    for (dev = devs; *dev && Step == NULL; dev++) {
+        if (libusb_get_bus_number(*dev) == info->bus
+            && libusb_get_device_address(*dev) == info->address) {
+            Step = device_open(*dev, NULL, timeout);
         }
+    }
 
+    libusb_free_device_list(devs, 1);
     return Step;
 }
 
 // ----------------------------------------------------------------------------
 
+void device_exit() {
+    if (usbContext != NULL) {
+        libusb_exit(usbContext);
+        usbContext = NULL;
+    }
+#ifdef LINUX
+    free(sysfsCache);
+    sysfsCache = NULL;
+    sysfsCapacity = 0;
+    sysfsCount = -1;
+#endif
+}
+
+// ----------------------------------------------------------------------------
+
+void device_close(stepDevice* Step) {
+
+    if (Step == NULL) {
+        return;
+    }
+
+    // Requests in flight would complete into freed memory, cancel them and
+    // let their callbacks run. Every one has a deadline, so this ends.
+    for (;;) {
+        int pending = 0;
+
+        for (stt_request *request = requestsInFlight; request; request = request->next) {
+            if (request->Step == Step) {
+                if (!request->cancelled) cancelRequest(request);
+                pending = 1;
+            }
+        }
+
+        if (!pending) break;
+
+        // Refused inside a callback, better leak the device than free it
+        int res = libusb_handle_events(usbContext);
+        if (res < 0 && res != LIBUSB_ERROR_INTERRUPTED) return;
+    }
+
+    libusb_close(Step->device);
+    free(Step->keys);
+    free(Step);
+}
+
+// ----------------------------------------------------------------------------
+
+// GET_KEY reply: keys, then the generation and a CRC-16 of the keys
+#define KEYS_REPLY_EXTRA    4
+
+// Take the keys, generation and CRC from a GET_KEY reply of res bytes
+static void keysFromReply(stepDevice* Step, const unsigned char* buffer, int res) {
+
+    int keysLength = Step->numKeys * sizeof(stt_keymap);
+    if (res < keysLength) {
+        return;
+    }
+
+    memcpy(Step->keys, buffer, keysLength);
+
+    // Older firmware sends the keys only, or no CRC
+    Step->generation = (res >= keysLength + 2)
+        ? (buffer[keysLength] | (buffer[keysLength + 1] << 8)) : 0;
+    Step->keysCrc = (res >= keysLength + 4)
+        ? (buffer[keysLength + 2] | (buffer[keysLength + 3] << 8)) : 0;
+}
+
+// ----------------------------------------------------------------------------
+
 int getDeviceInfo(stepDevice* Step) {
 
-    unsigned char buffer[6];
+    int keysLength = Step->numKeys * sizeof(stt_keymap);
+    unsigned char *buffer = malloc(keysLength + KEYS_REPLY_EXTRA);
+
+    if (buffer == NULL) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
 
     int res = libusb_control_transfer(Step->device,           // Device
                                                               // bmRequestType
@@ -52,50 +535,153 @@ int getDeviceInfo(stepDevice* Step) {
         0,                                                    // wValue
         0,                                                    // wIndex
         buffer,                                               // Destination
-        6,                                                    // wLength
+        keysLength + KEYS_REPLY_EXTRA,                        // wLength
         STEPTOTALK_USB_TIMEOUT);                              // Timeout
 
-    if (res >= 0) {
-        Step->mod1 = buffer[0];
-        Step->key1 = buffer[1];
-        Step->mod2 = buffer[2];
-        Step->key2 = buffer[3];
-        Step->mod3 = buffer[4];
-        Step->key3 = buffer[5];
-    }
+    keysFromReply(Step, buffer, res);
 
+    free(buffer);
     return res;
 
 }
 
 // ----------------------------------------------------------------------------
 
-void printKeyMapping(stepDevice* Step) {
-    printf("\r                              ");
-    printf("\rMod 1\tKey 1\tMod 2\tKey 2\tMod 3\tKey 3\n");
-    printf("%d\t%d\t%d\t%d\t%d\t%d\n",
-            Step->mod1,
-            Step->key1,
-            Step->mod2,
-            Step->key2,
-            Step->mod3,
-            Step->key3);
+// Wire format of STEPTOTALK_GET_CAPS, little endian
+static void capsFromBytes(stt_caps* caps, const unsigned char* buffer) {
+    caps->protocol      = buffer[0];
+    caps->numKeys       = buffer[1];
+    caps->numProfiles   = buffer[2];
+    caps->features      = buffer[3] | (buffer[4] << 8);
+    caps->eepromSize    = buffer[5] | (buffer[6] << 8);
+    caps->logStart      = buffer[7] | (buffer[8] << 8);
+    caps->recordSize    = buffer[9];
+    caps->logSlots      = buffer[10];
+    caps->maxTransfer   = buffer[11];
+    caps->debounceMaxMs = buffer[12];
 }
 
 // ----------------------------------------------------------------------------
 
-int updateKeyMapping(stepDevice* Step, uint8_t index, uint8_t modifier, uint8_t scancode) {
+// Cache file for this serial and firmware version, 0 if there is nowhere
+// to keep one
+static int capsCachePath(stepDevice* Step, char* path, size_t size) {
+#ifdef WIN
+    return 0;
+#else
+    const char *base = getenv("XDG_CACHE_HOME");
+    char dir[256];
 
-    uint16_t newValue = (scancode << 8) | (modifier & 0xFF);
+    // Only a serial of its own and a version that carries the protocol
+    // tell this firmware apart from another's
+    if (Step->serial[0] == '\0' || strcmp(Step->serial, STT_FALLBACK_SERIAL) == 0
+        || ((Step->version.major << 8) | Step->version.minor) < STT_CAPS_MIN_VERSION) {
+        return 0;
+    }
+
+    if (base != NULL && base[0] != '\0') {
+        snprintf(dir, sizeof(dir), "%s/steptotalk", base);
+    } else if ((base = getenv("HOME")) != NULL) {
+        snprintf(dir, sizeof(dir), "%s/.cache/steptotalk", base);
+    } else {
+        return 0;
+    }
+
+    // Serial numbers come from the device, keep them to safe characters
+    for (const char *c = Step->serial; *c; c++) {
+        if (!isalnum((unsigned char)*c)) {
+            return 0;
+        }
+    }
+
+    mkdir(dir, 0755);
+    // The minor version is the protocol, see STT_CAPS_MIN_VERSION
+    snprintf(path, size, "%s/%s-v%u-p%u.caps", dir, Step->serial,
+            Step->version.major, Step->version.minor);
+    return 1;
+#endif
+}
+
+// ----------------------------------------------------------------------------
+
+static int fetchCapabilities(stepDevice* Step, unsigned int timeout) {
+
+    unsigned char buffer[STT_CAPS_SIZE];
+    char path[320];
+    int cached = capsCachePath(Step, path, sizeof(path));
+
+    if (cached) {
+        FILE *file = fopen(path, "rb");
+        if (file != NULL) {
+            size_t length = fread(buffer, 1, sizeof(buffer), file);
+            fclose(file);
+            if (length == sizeof(buffer) && buffer[0] == Step->version.minor) {
+                capsFromBytes(&Step->caps, buffer);
+                return 0;
+            }
+        }
+    }
 
     int res = libusb_control_transfer(Step->device,           // Device
                                                               // bmRequestType
         LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_DEVICE,
-        STEPTOTALK_SET_KEY,                                   // bRequest
-        newValue,                                             // wValue
-        index,                                                // wIndex
-        NULL,                                                 // Destination
-        0,                                                    // wLength
+        STEPTOTALK_GET_CAPS,                                  // bRequest
+        0,                                                    // wValue
+        0,                                                    // wIndex
+        buffer,                                               // Destination
+        sizeof(buffer),                                       // wLength
+        timeout ? timeout : STEPTOTALK_USB_TIMEOUT);         // Timeout
+
+    if (res < (int)sizeof(buffer)) {
+        // Firmware from before GET_CAPS, or no answer, not worth caching
+        memset(&Step->caps, 0, sizeof(Step->caps));
+        Step->caps.numKeys = STT_NUM_KEYS;
+        Step->caps.eepromSize = STT_EEPROM_SIZE;
+        return res;
+    }
+
+    capsFromBytes(&Step->caps, buffer);
+
+    if (cached) {
+        FILE *file = fopen(path, "wb");
+        if (file != NULL) {
+            fwrite(buffer, 1, sizeof(buffer), file);
+            fclose(file);
+        }
+    }
+
+    return res;
+}
+
+// ----------------------------------------------------------------------------
+
+int getDeviceCapabilities(stepDevice* Step) {
+    return fetchCapabilities(Step, 0);
+}
+
+// ----------------------------------------------------------------------------
+
+int updateSerial(stepDevice* Step, const char* serial) {
+
+    int length = strlen(serial);
+
+    if (length == 0 || length > STT_SERIAL_MAX_LENGTH) {
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    for (int i = 0; i < length; i++) {
+        if (!isalnum((unsigned char)serial[i])) {
+            return LIBUSB_ERROR_INVALID_PARAM;
+        }
+    }
+
+    int res = libusb_control_transfer(Step->device,           // Device
+                                                              // bmRequestType
+        LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_DEVICE,
+        STEPTOTALK_SET_SERIAL,                                // bRequest
+        0,                                                    // wValue
+        0,                                                    // wIndex
+        (unsigned char *)serial,                              // Source
+        length,                                               // wLength
         STEPTOTALK_USB_TIMEOUT);                              // Timeout
 
     return res;
@@ -103,16 +689,781 @@ int updateKeyMapping(stepDevice* Step, uint8_t index, uint8_t modifier, uint8_t
 
 // ----------------------------------------------------------------------------
 
-void printHelp() {
-    puts("====================================================================");
-    puts("                        Step-to-Talk CLI Help");
-    puts("====================================================================");
-    puts(STEPTOTALK_USAGE);
+void printKeyMapping(stepDevice* Step) {
+    printf("\r                              \r");
+    for (int i = 0; i < Step->numKeys; i++) {
+        printf("%sMod %d\tKey %d", i ? "\t" : "", i + 1, i + 1);
+    }
+    puts("");
+    for (int i = 0; i < Step->numKeys; i++) {
+        printf("%s%d\t%d", i ? "\t" : "", Step->keys[i].modifier, Step->keys[i].scancode);
+    }
+    puts("");
+}
+
+// ----------------------------------------------------------------------------
+
+int getDeviceStatus(stepDevice* Step, stt_status* status) {
+
+    // Older firmware sends fewer fields or none, those read as zero
+    unsigned char buffer[7] = { 0 };
+
+    int res = libusb_control_transfer(Step->device,           // Device
+                                                              // bmRequestType
+        LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_DEVICE,
+        STEPTOTALK_GET_STATUS,                                // bRequest
+        0,                                                    // wValue
+        0,                                                    // wIndex
+        buffer,                                               // Destination
+        sizeof(buffer),                                       // wLength
+        STEPTOTALK_USB_TIMEOUT);                              // Timeout
+
+    if (res >= 0) {
+        status->reportOverflows = buffer[0] | (buffer[1] << 8);
+        status->sofCount        = buffer[2];
+        status->pickupFrame     = buffer[3];
+        status->pickupLatency   = buffer[4];
+        status->pollPeriod      = buffer[5];
+        status->persistPending  = buffer[6];
+    }
+
+    return res;
+}
+
+// ----------------------------------------------------------------------------
+
+void printDeviceStatus(stt_status* status) {
+    printf("\r                              ");
+    printf("\rOverflows\tLatency\tPeriod\tPhase\tSaving\n");
+
+    // Phase: frames since the last observed host poll, modulo its period
+    if (status->pollPeriod) {
+        printf("%u\t\t%u\t%u\t%u\t%s\n",
+                status->reportOverflows,
+                status->pickupLatency,
+                status->pollPeriod,
+                (uint8_t)(status->sofCount - status->pickupFrame) % status->pollPeriod,
+                status->persistPending ? "yes" : "no");
+    } else {
+        printf("%u\t\t%u\t-\t-\t%s\n",
+                status->reportOverflows,
+                status->pickupLatency,
+                status->persistPending ? "yes" : "no");
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+int updateKeyMapping(stepDevice* Step, uint8_t index, uint8_t modifier, uint8_t scancode) {
+
+    uint16_t newValue = (scancode << 8) | (modifier & 0xFF);
+
+    int res = libusb_control_transfer(Step->device,           // Device
+                                                              // bmRequestType
+        LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_DEVICE,
+        STEPTOTALK_SET_KEY,                                   // bRequest
+        newValue,                                             // wValue
+        index,                                                // wIndex
+        NULL,                                                 // Destination
+        0,                                                    // wLength
+        STEPTOTALK_USB_TIMEOUT);                              // Timeout
+
+    return res;
+}
+
+// ----------------------------------------------------------------------------
+
+static int sendAllKeys(stepDevice* Step, uint8_t request, const stt_keymap* keys) {
+
+    // stt_keymap matches the device layout, send it as is
+    int res = libusb_control_transfer(Step->device,           // Device
+                                                              // bmRequestType
+        LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_DEVICE,
+        request,                                              // bRequest
+        0,                                                    // wValue
+        0,                                                    // wIndex
+        (unsigned char *)keys,                                // Source
+        Step->numKeys * sizeof(stt_keymap),                   // wLength
+        STEPTOTALK_USB_TIMEOUT);                              // Timeout
+
+    return res;
+}
+
+// ----------------------------------------------------------------------------
+
+int updateAllKeys(stepDevice* Step, const stt_keymap* keys) {
+    return sendAllKeys(Step, STEPTOTALK_SET_ALL_KEYS, keys);
+}
+
+// ----------------------------------------------------------------------------
+
+int overrideAllKeys(stepDevice* Step, const stt_keymap* keys) {
+    return sendAllKeys(Step, STEPTOTALK_SET_KEYS_VOLATILE, keys);
+}
+
+// ----------------------------------------------------------------------------
+
+int persistKeys(stepDevice* Step) {
+
+    int res = libusb_control_transfer(Step->device,           // Device
+                                                              // bmRequestType
+        LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_DEVICE,
+        STEPTOTALK_PERSIST_KEYS,                              // bRequest
+        0,                                                    // wValue
+        0,                                                    // wIndex
+        NULL,                                                 // Destination
+        0,                                                    // wLength
+        STEPTOTALK_USB_TIMEOUT);                              // Timeout
+
+    return res;
+}
+
+// ----------------------------------------------------------------------------
+
+int beginKeys(stepDevice* Step) {
+
+    int res = libusb_control_transfer(Step->device,           // Device
+                                                              // bmRequestType
+        LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_DEVICE,
+        STEPTOTALK_BEGIN_KEYS,                                // bRequest
+        0,                                                    // wValue
+        0,                                                    // wIndex
+        NULL,                                                 // Destination
+        0,                                                    // wLength
+        STEPTOTALK_USB_TIMEOUT);                              // Timeout
+
+    return res;
+}
+
+// ----------------------------------------------------------------------------
+
+int stageKey(stepDevice* Step, uint8_t index, uint8_t modifier, uint8_t scancode) {
+
+    uint16_t newValue = (scancode << 8) | (modifier & 0xFF);
+
+    int res = libusb_control_transfer(Step->device,           // Device
+                                                              // bmRequestType
+        LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_DEVICE,
+        STEPTOTALK_STAGE_KEY,                                 // bRequest
+        newValue,                                             // wValue
+        index,                                                // wIndex
+        NULL,                                                 // Destination
+        0,                                                    // wLength
+        STEPTOTALK_USB_TIMEOUT);                              // Timeout
+
+    return res;
+}
+
+// ----------------------------------------------------------------------------
+
+int commitKeys(stepDevice* Step) {
+
+    unsigned char committed = 0;
+
+    int res = libusb_control_transfer(Step->device,           // Device
+                                                              // bmRequestType
+        LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_DEVICE,
+        STEPTOTALK_COMMIT_KEYS,                               // bRequest
+        0,                                                    // wValue
+        0,                                                    // wIndex
+        &committed,                                           // Destination
+        1,                                                    // wLength
+        STEPTOTALK_USB_TIMEOUT);                              // Timeout
+
+    if (res < 0) {
+        return res;
+    }
+
+    return res == 1 && committed;
+}
+
+// ----------------------------------------------------------------------------
+
+int abortKeys(stepDevice* Step) {
+
+    int res = libusb_control_transfer(Step->device,           // Device
+                                                              // bmRequestType
+        LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_DEVICE,
+        STEPTOTALK_ABORT_KEYS,                                // bRequest
+        0,                                                    // wValue
+        0,                                                    // wIndex
+        NULL,                                                 // Destination
+        0,                                                    // wLength
+        STEPTOTALK_USB_TIMEOUT);                              // Timeout
+
+    return res;
+}
+
+// ----------------------------------------------------------------------------
+
+int getProfile(stepDevice* Step, uint8_t* active, uint8_t* count) {
+
+    unsigned char buffer[2];
+
+    int res = libusb_control_transfer(Step->device,           // Device
+                                                              // bmRequestType
+        LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_DEVICE,
+        STEPTOTALK_GET_PROFILE,                               // bRequest
+        0,                                                    // wValue
+        0,                                                    // wIndex
+        buffer,                                               // Destination
+        sizeof(buffer),                                       // wLength
+        STEPTOTALK_USB_TIMEOUT);                              // Timeout
+
+    if (res >= 2) {
+        *active = buffer[0];
+        *count  = buffer[1];
+    } else if (res >= 0) {
+        res = LIBUSB_ERROR_NOT_SUPPORTED;
+    }
+
+    return res;
+}
+
+// ----------------------------------------------------------------------------
+
+int setProfile(stepDevice* Step, uint8_t profile) {
+
+    int res = libusb_control_transfer(Step->device,           // Device
+                                                              // bmRequestType
+        LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_DEVICE,
+        STEPTOTALK_SET_PROFILE,                               // bRequest
+        0,                                                    // wValue
+        profile,                                              // wIndex
+        NULL,                                                 // Destination
+        0,                                                    // wLength
+        STEPTOTALK_USB_TIMEOUT);                              // Timeout
+
+    return res;
+}
+
+// ----------------------------------------------------------------------------
+
+int readEeprom(stepDevice* Step, uint16_t address, uint8_t* buffer, uint16_t length) {
+
+    uint16_t done = 0;
+
+    while (done < length) {
+        uint16_t chunk = length - done;
+        if (chunk > STT_EEPROM_CHUNK) {
+            chunk = STT_EEPROM_CHUNK;
+        }
+
+        int res = libusb_control_transfer(Step->device,       // Device
+                                                              // bmRequestType
+            LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_DEVICE,
+            STEPTOTALK_READ_EEPROM,                           // bRequest
+            0,                                                // wValue
+            address + done,                                   // wIndex
+            buffer + done,                                    // Destination
+            chunk,                                            // wLength
+            STEPTOTALK_USB_TIMEOUT);                          // Timeout
+
+        if (res < 0) {
+            return res;
+        }
+
+        done += res;
+
+        // Short read, end of EEPROM
+        if (res < chunk) {
+            break;
+        }
+    }
+
+    return done;
+}
+
+// ----------------------------------------------------------------------------
+
+// Write a range without ending the restore unless last is set. The device
+// holds back its own records from the first write until the last one.
+static int sendEeprom(stepDevice* Step, uint16_t address, const uint8_t* buffer,
+        uint16_t length, uint8_t last) {
+
+    uint16_t done = 0;
+
+    do {
+        uint16_t chunk = length - done;
+        if (chunk > STT_EEPROM_CHUNK) {
+            chunk = STT_EEPROM_CHUNK;
+        }
+
+        int res = libusb_control_transfer(Step->device,       // Device
+                                                              // bmRequestType
+            LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_DEVICE,
+            STEPTOTALK_WRITE_EEPROM,                          // bRequest
+            (last && done + chunk == length)                  // wValue
+                ? STT_EEPROM_WRITE_LAST : 0,
+            address + done,                                   // wIndex
+            (uint8_t *)buffer + done,                         // Source
+            chunk,                                            // wLength
+            STEPTOTALK_USB_TIMEOUT);                          // Timeout
+
+        if (res < 0) {
+            return res;
+        }
+
+        done += chunk;
+    } while (done < length);
+
+    return done;
+}
+
+// ----------------------------------------------------------------------------
+
+int writeEeprom(stepDevice* Step, uint16_t address, const uint8_t* buffer, uint16_t length) {
+    return sendEeprom(Step, address, buffer, length, 1);
+}
+
+// ----------------------------------------------------------------------------
+
+int backupEeprom(stepDevice* Step, uint8_t* image) {
+
+    stt_status status;
+
+    // Changes are saved in the background, give them a moment to land
+    for (int tries = 0; tries < 50; tries++) {
+        int res = getDeviceStatus(Step, &status);
+        if (res < 0) {
+            return res;
+        }
+        if (!status.persistPending) {
+            break;
+        }
+        delay(20);
+    }
+
+    return readEeprom(Step, 0, image, STT_EEPROM_SIZE);
+}
+
+// ----------------------------------------------------------------------------
+
+int restoreEeprom(stepDevice* Step, const uint8_t* image) {
+
+    uint8_t current[STT_EEPROM_SIZE];
+    int changed = 0;
+
+    int res = backupEeprom(Step, current);
+    if (res < 0) {
+        return res;
+    } else if (res < STT_EEPROM_SIZE) {
+        return LIBUSB_ERROR_IO;
+    }
+
+    uint16_t address = 0;
+
+    while (address < STT_EEPROM_SIZE) {
+
+        if (current[address] == image[address]) {
+            address++;
+            continue;
+        }
+
+        // Send each run of differing bytes in one go
+        uint16_t end = address;
+        while (end < STT_EEPROM_SIZE && current[end] != image[end]) {
+            end++;
+        }
+
+        res = sendEeprom(Step, address, image + address, end - address, 0);
+        if (res < 0) {
+            return res;
+        }
+
+        changed += end - address;
+        address = end;
+    }
+
+    // Only now is the record log whole, let the device reload it once
+    if (changed) {
+        res = sendEeprom(Step, 0, NULL, 0, 1);
+        if (res < 0) {
+            return res;
+        }
+    }
+
+    return changed;
+}
+
+// ----------------------------------------------------------------------------
+
+int updateSetting(stepDevice* Step, uint8_t setting, uint8_t value) {
+
+    int res = libusb_control_transfer(Step->device,           // Device
+                                                              // bmRequestType
+        LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_DEVICE,
+        STEPTOTALK_SET_SETTING,                               // bRequest
+        value,                                                // wValue
+        setting,                                              // wIndex
+        NULL,                                                 // Destination
+        0,                                                    // wLength
+        STEPTOTALK_USB_TIMEOUT);                              // Timeout
+
+    return res;
+}
+
+// ----------------------------------------------------------------------------
+
+int updateDebounce(stepDevice* Step, uint8_t index, uint8_t window, uint8_t mode) {
+
+    uint16_t newValue = (mode << 8) | (window & 0xFF);
+
+    int res = libusb_control_transfer(Step->device,           // Device
+                                                              // bmRequestType
+        LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_DEVICE,
+        STEPTOTALK_SET_DEBOUNCE,                              // bRequest
+        newValue,                                             // wValue
+        index,                                                // wIndex
+        NULL,                                                 // Destination
+        0,                                                    // wLength
+        STEPTOTALK_USB_TIMEOUT);                              // Timeout
+
+    return res;
+}
+
+// ----------------------------------------------------------------------------
+
+static void LIBUSB_CALL requestDone(struct libusb_transfer *transfer) {
+
+    stt_request *request = transfer->user_data;
+    stepDevice *Step = request->Step;
+    int res;
+
+    switch (transfer->status) {
+        case LIBUSB_TRANSFER_COMPLETED:
+            res = transfer->actual_length;
+            break;
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            res = LIBUSB_ERROR_TIMEOUT;
+            break;
+        case LIBUSB_TRANSFER_STALL:
+            res = LIBUSB_ERROR_PIPE;
+            break;
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            res = LIBUSB_ERROR_NO_DEVICE;
+            break;
+        case LIBUSB_TRANSFER_CANCELLED:
+            res = LIBUSB_ERROR_INTERRUPTED;
+            break;
+        case LIBUSB_TRANSFER_OVERFLOW:
+            res = LIBUSB_ERROR_OVERFLOW;
+            break;
+        default:
+            res = LIBUSB_ERROR_IO;
+            break;
+    }
+
+    if (request->reply == REPLY_KEYS) {
+        keysFromReply(Step, libusb_control_transfer_get_data(transfer), res);
+    }
+
+    // Off the list first, the callback may close the device
+    for (stt_request **link = &requestsInFlight; *link; link = &(*link)->next) {
+        if (*link == request) {
+            *link = request->next;
+            break;
+        }
+    }
+
+    if (request->callback != NULL) {
+        request->callback(request, res, request->userData);
+    }
+
+    // libusb frees the transfer and its buffer once this returns
+    free(request);
+}
+
+// ----------------------------------------------------------------------------
+
+// Asynchronous counterpart of libusb_control_transfer. Data for an OUT
+// request is copied, an IN reply is read from the transfer's own buffer.
+static int submitRequest(stepDevice* Step, uint8_t requestType, uint8_t bRequest,
+        uint16_t wValue, uint16_t wIndex, const void* data, uint16_t wLength,
+        uint8_t reply, unsigned int deadline, stt_callback callback,
+        void* userData, stt_request** handle) {
+
+    int res = usbContextInit();
+    if (res < 0) return res;
+
+    stt_request *request = malloc(sizeof(stt_request));
+    unsigned char *buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + wLength);
+    struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+
+    if (request == NULL || buffer == NULL || transfer == NULL) {
+        free(request);
+        free(buffer);
+        libusb_free_transfer(transfer);
+        return LIBUSB_ERROR_NO_MEM;
+    }
+
+    request->Step = Step;
+    request->transfer = transfer;
+    request->callback = callback;
+    request->userData = userData;
+    request->reply = reply;
+    request->cancelled = 0;
+
+    libusb_fill_control_setup(buffer, requestType, bRequest, wValue, wIndex, wLength);
+    if (!(requestType & LIBUSB_ENDPOINT_IN) && wLength > 0) {
+        memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, data, wLength);
+    }
+
+    libusb_fill_control_transfer(transfer, Step->device, buffer, requestDone,
+        request, deadline ? deadline : STEPTOTALK_USB_TIMEOUT);
+    transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
+
+    res = libusb_submit_transfer(transfer);
+    if (res < 0) {
+        libusb_free_transfer(transfer);
+        free(request);
+        return res;
+    }
+
+    request->next = requestsInFlight;
+    requestsInFlight = request;
+
+    if (handle != NULL) *handle = request;
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+
+int getDeviceInfoAsync(stepDevice* Step, unsigned int deadline,
+        stt_callback callback, void* userData, stt_request** request) {
+
+    return submitRequest(Step,
+        LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_DEVICE,
+        STEPTOTALK_GET_KEY,                                   // bRequest
+        0,                                                    // wValue
+        0,                                                    // wIndex
+        NULL,                                                 // Source
+        Step->numKeys * sizeof(stt_keymap) + KEYS_REPLY_EXTRA,// wLength
+        REPLY_KEYS, deadline, callback, userData, request);
+}
+
+// ----------------------------------------------------------------------------
+
+int updateKeyMappingAsync(stepDevice* Step, uint8_t index, uint8_t modifier,
+        uint8_t scancode, unsigned int deadline, stt_callback callback,
+        void* userData, stt_request** request) {
+
+    uint16_t newValue = (scancode << 8) | (modifier & 0xFF);
+
+    return submitRequest(Step,
+        LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_DEVICE,
+        STEPTOTALK_SET_KEY,                                   // bRequest
+        newValue,                                             // wValue
+        index,                                                // wIndex
+        NULL,                                                 // Source
+        0,                                                    // wLength
+        REPLY_NONE, deadline, callback, userData, request);
+}
+
+// ----------------------------------------------------------------------------
+
+int updateAllKeysAsync(stepDevice* Step, const stt_keymap* keys,
+        unsigned int deadline, stt_callback callback, void* userData,
+        stt_request** request) {
+
+    return submitRequest(Step,
+        LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_RECIPIENT_DEVICE,
+        STEPTOTALK_SET_ALL_KEYS,                              // bRequest
+        0,                                                    // wValue
+        0,                                                    // wIndex
+        keys,                                                 // Source
+        Step->numKeys * sizeof(stt_keymap),                   // wLength
+        REPLY_NONE, deadline, callback, userData, request);
+}
+
+// ----------------------------------------------------------------------------
+
+int cancelRequest(stt_request* request) {
+    request->cancelled = 1;
+    return libusb_cancel_transfer(request->transfer);
+}
+
+// ----------------------------------------------------------------------------
+
+const struct libusb_pollfd** getPollFds(void) {
+    if (usbContextInit() < 0) return NULL;
+    return libusb_get_pollfds(usbContext);
+}
+
+// ----------------------------------------------------------------------------
+
+void setPollFdNotifiers(libusb_pollfd_added_cb added,
+        libusb_pollfd_removed_cb removed, void* userData) {
+    if (usbContextInit() < 0) return;
+    libusb_set_pollfd_notifiers(usbContext, added, removed, userData);
+}
+
+// ----------------------------------------------------------------------------
+
+int getNextTimeout(struct timeval* tv) {
+    int res = usbContextInit();
+    return res < 0 ? res : libusb_get_next_timeout(usbContext, tv);
+}
+
+// ----------------------------------------------------------------------------
+
+int handleEvents(void) {
+
+    struct timeval tv = { 0, 0 };
+
+    int res = usbContextInit();
+    return res < 0 ? res : libusb_handle_events_timeout_completed(usbContext, &tv, NULL);
+}
+
+// ----------------------------------------------------------------------------
+
+// Bookkeeping for one device of a provisionDevices call
+typedef struct {
+    stt_provision *job;
+    stt_request *request;                       // NULL once completed
+    struct timespec start;
+    int *pending;
+} provisionState;
+
+static void provisionDone(stt_request *request, int result, void *userData) {
+
+    provisionState *state = userData;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    state->job->elapsedMs = (now.tv_sec - state->start.tv_sec) * 1000
+        + (now.tv_nsec - state->start.tv_nsec) / 1000000;
+    state->job->result = result;
+    state->request = NULL;
+
+    (*state->pending)--;
+}
+
+// ----------------------------------------------------------------------------
+
+int provisionDevices(stt_provision* jobs, int count, unsigned int timeout) {
+
+    int pending = 0;
+    int failed = 0;
+
+    int res = usbContextInit();
+    if (res < 0) return res;
+
+    provisionState *states = calloc(count ? count : 1, sizeof(provisionState));
+    if (states == NULL) return LIBUSB_ERROR_NO_MEM;
+
+    // Submit everything before waiting on anything
+    for (int i = 0; i < count; i++) {
+        jobs[i].result = 0;
+        jobs[i].elapsedMs = 0;
+
+        if (!(jobs[i].Step->caps.features & STT_CAP_BULK_KEYS)) {
+            jobs[i].result = LIBUSB_ERROR_NOT_SUPPORTED;
+            continue;
+        }
+
+        states[i].job = &jobs[i];
+        states[i].pending = &pending;
+        clock_gettime(CLOCK_MONOTONIC, &states[i].start);
+
+        res = updateAllKeysAsync(jobs[i].Step, jobs[i].keys, timeout,
+            provisionDone, &states[i], &states[i].request);
+        if (res < 0) {
+            jobs[i].result = res;
+            continue;
+        }
+        pending++;
+    }
+
+    // Each request has its own deadline, so this drains as long as events
+    // are handled. On an error cancel everything and give it one more go,
+    // if that fails too give up with the error.
+    int cancelled = 0;
+    while (pending > 0) {
+        res = libusb_handle_events(usbContext);
+        if (res >= 0 || res == LIBUSB_ERROR_INTERRUPTED) {
+            continue;
+        }
+
+        if (!cancelled) {
+            cancelled = 1;
+            for (int i = 0; i < count; i++) {
+                if (states[i].request != NULL) cancelRequest(states[i].request);
+            }
+            continue;
+        }
+
+        // Requests still out must not complete into states once freed
+        for (int i = 0; i < count; i++) {
+            if (states[i].request != NULL) {
+                states[i].request->callback = NULL;
+                jobs[i].result = res;
+            }
+        }
+        free(states);
+        return res;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (jobs[i].result < 0) failed++;
+    }
+    free(states);
+
+    return failed;
+}
+
+// ----------------------------------------------------------------------------
+
+void printHelp() {
+    puts("====================================================================");
+    puts("                        Step-to-Talk CLI Help");
+    puts("====================================================================");
+    puts(STEPTOTALK_USAGE);
+    puts("");
+    puts("One operation per run: a key update or one of the options below");
+    puts("other than --serial, --path and --all, which pick the device.");
     puts("");
     puts("   --help: This help text");
     puts("       -h: Alias for --help");
     puts("   --show: Get and show current keymapping from device");
     puts("       -s: Alias for --show");
+    puts(" --status: Get and show device status counters");
+    puts("   --report-mode array|nkro:");
+    puts("           HID report format used after the next replug. 'array'");
+    puts("           suits any host, 'nkro' reports every pressed usage");
+    puts("           as a bitmap and allows keys above 101 such as F13-F24.");
+    puts("   --sof-align on|off:");
+    puts("           Lock input sampling to the USB frame clock so every");
+    puts("           sample lands at the same point late in the frame.");
+    puts("   --poll-interval ms:");
+    puts("           Interrupt poll interval requested from the host after");
+    puts("           the next replug, 1-254 ms. Default 10.");
+    puts("   --profile n:");
+    puts("           Switch to keymap profile n, 0-3. Key updates go to the");
+    puts("           active profile. The device starts in profile 0.");
+    puts("   --profile-combo mask:");
+    puts("           Keys that cycle profiles when pressed together, bit n");
+    puts("           for key n, e.g. 5 for keys 0 and 2. 0 turns it off.");
+    puts("   --backup FILE:");
+    puts("           Save the device's whole EEPROM to FILE.");
+    puts("   --restore FILE:");
+    puts("           Write an EEPROM image saved by --backup to the device,");
+    puts("           changing only bytes that differ. The oscillator");
+    puts("           calibration and serial number of the device are kept.");
+    puts("   --set-serial S:");
+    puts("           Give the device its own serial number, up to 8 letters");
+    puts("           and digits, reported from the next replug.");
+    puts("   --list: List attached devices with serial number and USB path");
+    puts(" --serial S:");
+    puts("           Only use the device with serial number S.");
+    puts("   --path P:");
+    puts("           Only use the device at USB path P, as shown by --list.");
+    puts("    --all: Apply the operation to every attached device.");
+    puts("provision MANIFEST:");
+    puts("           Write keymaps to every attached device listed in");
+    puts("           MANIFEST at once. Each line holds a serial number, or");
+    puts("           * for any other device, then modifier:scancode per");
+    puts("           key, e.g. 'PEDAL01 0:104 0:105 0:106'.");
     puts(" modifier: Bitwise flags for modifier key(s) to use. In decimal.");
     puts("");
     puts("           0 0 0 0 0 0 0 0");
@@ -19,9 +19,10 @@
 // ============================================================================
 
 #define STEPTOTALK_CLI_VERSION "Step-to-Talk CLI Tool Version: 1.0"
-#define STEPTOTALK_USAGE "Usage: steptotalk [--help] [--show] [modifier scancode [index]]"
+#define STEPTOTALK_USAGE "Usage: steptotalk [--help] [--show] [--status] [--report-mode array|nkro] [--sof-align on|off] [--poll-interval ms] [--profile n] [--profile-combo mask] [--backup FILE] [--restore FILE] [--set-serial S] [--list] [--serial S | --path P | --all] [modifier scancode [index]]\n       steptotalk provision MANIFEST"
 
 #define CONNECT_WAIT 250        // Wait time after detecting device on USB
+#define PROVISION_TIMEOUT 2000  // Per-device limit when writing many at once
 
 // ============================================================================
 // DEVICE DETAILS
@@ -35,16 +36,79 @@
 // USB CONTROL CODES
 // ----------------------------------------------------------------------------
 
-#define STEPTOTALK_GET_KEY   0
-#define STEPTOTALK_SET_KEY   1
+#define STEPTOTALK_GET_KEY          0
+#define STEPTOTALK_SET_KEY          1
+#define STEPTOTALK_GET_DEBOUNCE     2
+#define STEPTOTALK_SET_DEBOUNCE     3
+#define STEPTOTALK_GET_STATUS       4
+#define STEPTOTALK_GET_SETTINGS     5
+#define STEPTOTALK_SET_SETTING      6
+#define STEPTOTALK_SET_ALL_KEYS     7   // Whole keymap in the data stage
+#define STEPTOTALK_READ_EEPROM      8   // Address in wIndex
+#define STEPTOTALK_WRITE_EEPROM     9   // Address in wIndex
+#define STT_EEPROM_WRITE_LAST   0x01    // WRITE_EEPROM wValue, reload once written
+#define STEPTOTALK_BEGIN_KEYS       10  // Keymap transaction, see commitKeys()
+#define STEPTOTALK_STAGE_KEY        11
+#define STEPTOTALK_COMMIT_KEYS      12
+#define STEPTOTALK_ABORT_KEYS       13
+#define STEPTOTALK_GET_PROFILE      14
+#define STEPTOTALK_SET_PROFILE      15  // Profile in wIndex
+#define STEPTOTALK_SET_KEYS_VOLATILE 16 // Whole keymap, RAM only
+#define STEPTOTALK_PERSIST_KEYS     17
+#define STEPTOTALK_GET_CAPS         18
+#define STEPTOTALK_SET_SERIAL       19  // Serial in the data stage
+
+// ----------------------------------------------------------------------------
+// DEVICE SETTINGS
+// ----------------------------------------------------------------------------
+
+// Settings take effect the next time the device enumerates
+#define STT_SETTING_REPORT_MODE     0
+#define STT_SETTING_SOF_ALIGN       1
+#define STT_SETTING_POLL_INTERVAL   2   // Interrupt-IN interval, 1-254 ms
+#define STT_SETTING_PROFILE_COMBO   3   // Keys that cycle profiles, bit n = key n
+
+#define STT_REPORT_MODE_ARRAY       0   // Modifiers and one array slot per key
+#define STT_REPORT_MODE_NKRO        1   // Bitmap of every keyboard usage
 
 // ----------------------------------------------------------------------------
 // DEVICE PARAMETERS
 // ----------------------------------------------------------------------------
 
-// Current min/max number of keys for STT devices
+// Keys on devices that predate GET_CAPS, see stt_caps for the real count
 #define STT_MIN_KEY_INDEX   0
 #define STT_MAX_KEY_INDEX   2
+#define STT_NUM_KEYS        (STT_MAX_KEY_INDEX + 1)
+
+// Debounce algorithms and limits
+#define STT_DEBOUNCE_EAGER      0   // Report edge at once, then hold for window
+#define STT_DEBOUNCE_DEFERRED   1   // Report edge once stable for window
+#define STT_DEBOUNCE_MAX_MS     127
+
+// Capabilities, see getDeviceCapabilities(). Firmware without GET_CAPS
+// reports protocol 0 with the layout below.
+#define STT_CAPS_SIZE           13  // Bytes returned by STEPTOTALK_GET_CAPS
+
+// From 1.1 on the device version's minor number is the protocol in caps
+#define STT_CAPS_MIN_VERSION    0x0101
+
+// Reported by every unit that was never given its own serial number
+#define STT_FALLBACK_SERIAL     "STT02"
+#define STT_CAP_NKRO            0x0001
+#define STT_CAP_SOF_ALIGN       0x0002
+#define STT_CAP_BULK_KEYS       0x0004
+#define STT_CAP_EEPROM_STREAM   0x0008
+#define STT_CAP_TRANSACTIONS    0x0010
+#define STT_CAP_PROFILES        0x0020
+#define STT_CAP_VOLATILE_KEYS   0x0040
+#define STT_CAP_DEBOUNCE        0x0080
+#define STT_CAP_SERIAL          0x0100
+
+#define STT_SERIAL_MAX_LENGTH   8   // Letters and digits only
+
+// EEPROM image, a log of configuration records written round robin
+#define STT_EEPROM_SIZE         512
+#define STT_EEPROM_CHUNK        128 // Bytes per control transfer, at most 254
 
 // ============================================================================
 // Declarations
@@ -57,28 +121,152 @@ typedef struct {
 
 // ----------------------------------------------------------------------------
 
+typedef struct {
+    uint16_t reportOverflows;   // Reports merged because the queue was full
+    uint8_t sofCount;           // Device frame counter when status was read
+    uint8_t pickupFrame;        // Frame counter at last report pickup
+    uint8_t pickupLatency;      // Frames from arming a report to its pickup
+    uint8_t pollPeriod;         // Measured host poll period in frames
+    uint8_t persistPending;     // Non-zero while changes await EEPROM
+} stt_status;
+
+// ----------------------------------------------------------------------------
+
+typedef struct {
+    uint8_t modifier;
+    uint8_t scancode;
+} stt_keymap;
+
+// ----------------------------------------------------------------------------
+
+typedef struct {
+    uint8_t protocol;           // Request set version, 0 before GET_CAPS
+    uint8_t numKeys;
+    uint8_t numProfiles;
+    uint16_t features;          // STT_CAP_* flags
+    uint16_t eepromSize;
+    uint16_t logStart;          // First configuration record slot
+    uint8_t recordSize;
+    uint8_t logSlots;
+    uint8_t maxTransfer;        // Largest EEPROM transfer in bytes
+    uint8_t debounceMaxMs;
+} stt_caps;
+
+// ----------------------------------------------------------------------------
+
+typedef struct {
+    char serial[32];
+    char path[32];              // Bus and port chain, e.g. 1-1.2
+    stt_version version;
+    uint8_t bus;
+    uint8_t address;
+} stt_device_info;
+
+// ----------------------------------------------------------------------------
+
 typedef struct {
     libusb_device_handle *device;
     stt_version version;
-    uint8_t mod1;
-    uint8_t mod2;
-    uint8_t mod3;
-    uint8_t key1;
-    uint8_t key2;
-    uint8_t key3;
+    char serial[32];
+    char path[32];
+    stt_caps caps;
+    uint8_t numKeys;                            // Entries in keys, from caps
+    stt_keymap *keys;                           // Same layout as the device's
+    uint16_t generation;                        // Keymap change counter
+    uint16_t keysCrc;                           // CRC-16 of keys, from the device
 } stepDevice;
 
+// ----------------------------------------------------------------------------
+
+typedef struct {
+    stepDevice *Step;
+    const stt_keymap *keys;     // Step->numKeys entries
+    int result;                 // Bytes sent or libusb error code
+    unsigned int elapsedMs;     // Submission to completion
+} stt_provision;
+
+// ----------------------------------------------------------------------------
+
+// Handle for an asynchronous request, valid until its callback returns
+typedef struct stt_request stt_request;
+
+// result is what the blocking call would have returned, or
+// LIBUSB_ERROR_TIMEOUT past the deadline and LIBUSB_ERROR_INTERRUPTED
+// once cancelled.
+//
+// Callbacks run from whichever library call next handles USB events:
+// handleEvents, but also provisionDevices, device_connect, device_close and
+// every blocking request, since libusb completes other transfers while it
+// waits for its own. A callback must not make blocking library calls, nor
+// call device_close or provisionDevices, libusb refuses to handle events
+// from inside a callback.
+typedef void (*stt_callback)(stt_request* request, int result, void* userData);
+
 // ============================================================================
 // FUNCTION PROTOTYPES
 // ============================================================================
 
 // ----------------------------------------------------------------------------
 // Function:    device_connect
-// Description: Find and connect to a Step-to-Talk device.
+// Description: Find and connect to a Step-to-Talk device. Where libusb
+//              supports hotplug, waits for one to be attached and connects
+//              as soon as it enumerates. Elsewhere scans the bus once.
+// Arguments:   unsigned int timeout: Longest wait in ms, 0 waits forever
+// Returns:     Device pointer, NULL if none was found
+// ----------------------------------------------------------------------------
+stepDevice* device_connect(unsigned int timeout);
+
+// ----------------------------------------------------------------------------
+// Function:    device_connect_serial
+// Description: As device_connect, but only connects to the device with the
+//              given serial number. On Linux candidates are picked from
+//              sysfs, so no other device is opened, and the listing is
+//              cached until a device is attached or a cached one is gone.
+//              Without a readable sysfs every device is tried in turn.
+// Arguments:   const char* serial: Serial number, NULL for any device
+//              unsigned int timeout: Longest wait in ms, 0 waits forever
+// Returns:     Device pointer, NULL if none was found
+// ----------------------------------------------------------------------------
+stepDevice* device_connect_serial(const char *serial, unsigned int timeout);
+
+// ----------------------------------------------------------------------------
+// Function:    device_list
+// Description: Lists every attached Step-to-Talk device. On Linux this is
+//              read from sysfs without opening anything. Elsewhere, or when
+//              sysfs cannot be read, each device is opened briefly to read
+//              its serial number.
+// Arguments:   stt_device_info** list: Receives the list, free it with
+//                                      device_list_free
+// Returns:     Number of devices or libusb error code
+// ----------------------------------------------------------------------------
+int device_list(stt_device_info** list);
+
+// ----------------------------------------------------------------------------
+// Function:    device_list_free
+// Description: Frees a list returned by device_list.
+// Arguments:   stt_device_info* list: List to free, may be NULL
+// Returns:     Nothing
+// ----------------------------------------------------------------------------
+void device_list_free(stt_device_info* list);
+
+// ----------------------------------------------------------------------------
+// Function:    device_connect_info
+// Description: Connects to one device from device_list.
+// Arguments:   stt_device_info* info: Device to connect to
+//           unsigned int timeout: Longest wait in ms for each request made
+//                                 while connecting, 0 for the default
+// Returns:     Device pointer, NULL if it is gone or cannot be opened
+// ----------------------------------------------------------------------------
+stepDevice* device_connect_info(const stt_device_info* info, unsigned int timeout);
+
+// ----------------------------------------------------------------------------
+// Function:    device_exit
+// Description: Releases the libusb context shared by all devices. Close
+//              every device first.
 // Arguments:   None
-// Returns:     Device pointer
+// Returns:     Nothing
 // ----------------------------------------------------------------------------
-stepDevice* device_connect();
+void device_exit();
 
 // ----------------------------------------------------------------------------
 // Function:    printHelp
@@ -88,15 +276,50 @@ stepDevice* device_connect();
 // ----------------------------------------------------------------------------
 void printHelp();
 
+// ----------------------------------------------------------------------------
+// Function:    device_close
+// Description: Closes the device and frees everything device_connect
+//              allocated for it. Requests still in flight on it are
+//              cancelled and their callbacks run before it returns. Must
+//              not be called from a request callback.
+// Arguments:   stepDevice* Step: Pointer to STT device, may be NULL
+// Returns:     Nothing
+// ----------------------------------------------------------------------------
+void device_close(stepDevice* Step);
+
 // ----------------------------------------------------------------------------
 // Function:    getDeviceInfo
 // Description: Retrieves information from device, including USB descriptors,
-//              device version, and key mapping.
+//              device version, key mapping and keymap generation. The
+//              generation can repeat after a power cycle, a keymap is only
+//              unchanged if generation and keysCrc both match.
 // Arguments:   None
 // Returns:     Nothing
 // ----------------------------------------------------------------------------
 int getDeviceInfo(stepDevice* step);
 
+// ----------------------------------------------------------------------------
+// Function:    getDeviceCapabilities
+// Description: Fills Step->caps. Answers are cached on disk by serial
+//              number and protocol, so only the first connection of a
+//              device asks it. Units on the fallback serial or on firmware
+//              older than STT_CAPS_MIN_VERSION are asked every time.
+// Arguments:   stepDevice* Step: Pointer to STT device
+// Returns:     libusb result code
+// ----------------------------------------------------------------------------
+int getDeviceCapabilities(stepDevice* Step);
+
+// ----------------------------------------------------------------------------
+// Function:    updateSerial
+// Description: Gives the device its own serial number, saved in EEPROM and
+//              reported from the next time it enumerates.
+// Arguments:   stepDevice* Step: Pointer to STT device
+//              const char* serial: 1 to STT_SERIAL_MAX_LENGTH letters and
+//                                  digits
+// Returns:     Number of bytes sent or libusb error code
+// ----------------------------------------------------------------------------
+int updateSerial(stepDevice* Step, const char* serial);
+
 // ----------------------------------------------------------------------------
 // Function:    printKeyMapping
 // Description: Outputs lightly formatted key mapping.
@@ -105,6 +328,23 @@ int getDeviceInfo(stepDevice* step);
 // ----------------------------------------------------------------------------
 void printKeyMapping(stepDevice* step);
 
+// ----------------------------------------------------------------------------
+// Function:    getDeviceStatus
+// Description: Retrieves runtime status counters from the device.
+// Arguments:   stepDevice* Step: Pointer to STT device
+//              stt_status* status: Destination for status
+// Returns:     libusb result code
+// ----------------------------------------------------------------------------
+int getDeviceStatus(stepDevice* Step, stt_status* status);
+
+// ----------------------------------------------------------------------------
+// Function:    printDeviceStatus
+// Description: Outputs lightly formatted device status.
+// Arguments:   stt_status* status: Status to print
+// Returns:     Nothing
+// ----------------------------------------------------------------------------
+void printDeviceStatus(stt_status* status);
+
 // ----------------------------------------------------------------------------
 // Function:    updateKeyMapping
 // Description: Sends data for one key to update device mapping and save
@@ -119,4 +359,284 @@ void printKeyMapping(stepDevice* step);
 // ----------------------------------------------------------------------------
 int updateKeyMapping(stepDevice* Step, uint8_t index, uint8_t modifier, uint8_t scancode);
 
+// ----------------------------------------------------------------------------
+// Function:    updateAllKeys
+// Description: Sends the complete key mapping in a single control transfer.
+//              The device applies it only once every byte has arrived and
+//              saves it to EEPROM in one pass.
+// Arguments:   stepDevice* Step: Pointer to STT device
+//              stt_keymap* keys: Step->numKeys key assignments, by index
+// Returns:     Number of bytes sent or libusb error code
+// ----------------------------------------------------------------------------
+int updateAllKeys(stepDevice* Step, const stt_keymap* keys);
+
+// ----------------------------------------------------------------------------
+// Function:    overrideAllKeys
+// Description: Like updateAllKeys, but the new mapping lives in device RAM
+//              only. It costs no EEPROM writes and is dropped on reset or
+//              profile switch unless kept with persistKeys.
+// Arguments:   stepDevice* Step: Pointer to STT device
+//              stt_keymap* keys: Step->numKeys key assignments, by index
+// Returns:     Number of bytes sent or libusb error code
+// ----------------------------------------------------------------------------
+int overrideAllKeys(stepDevice* Step, const stt_keymap* keys);
+
+// ----------------------------------------------------------------------------
+// Function:    persistKeys
+// Description: Saves the mapping set by overrideAllKeys to the active
+//              profile in EEPROM. Does nothing if there is no override.
+// Arguments:   stepDevice* Step: Pointer to STT device
+// Returns:     libusb result code
+// ----------------------------------------------------------------------------
+int persistKeys(stepDevice* Step);
+
+// ----------------------------------------------------------------------------
+// Function:    beginKeys
+// Description: Opens a keymap transaction on the device, starting from the
+//              live keymap. Any transaction already open is dropped.
+// Arguments:   stepDevice* Step: Pointer to STT device
+// Returns:     libusb result code
+// ----------------------------------------------------------------------------
+int beginKeys(stepDevice* Step);
+
+// ----------------------------------------------------------------------------
+// Function:    stageKey
+// Description: Changes one key in the open transaction. Nothing changes on
+//              the device until commitKeys().
+// Arguments:   stepDevice* Step: Pointer to STT device
+//                 uint8_t index: Index of key to assign
+//              uint8_t modifier: Bitwise modifier key assignment
+//              uint8_t scancode: Scancode of the key to assign
+// Returns:     libusb result code
+// ----------------------------------------------------------------------------
+int stageKey(stepDevice* Step, uint8_t index, uint8_t modifier, uint8_t scancode);
+
+// ----------------------------------------------------------------------------
+// Function:    commitKeys
+// Description: Makes every staged key live at once and saves them in a
+//              single EEPROM record. The device refuses if a staged index
+//              was invalid or the keymap was changed by anyone else since
+//              beginKeys(), leaving the live keymap untouched.
+// Arguments:   stepDevice* Step: Pointer to STT device
+// Returns:     1 if committed, 0 if refused, or libusb error code
+// ----------------------------------------------------------------------------
+int commitKeys(stepDevice* Step);
+
+// ----------------------------------------------------------------------------
+// Function:    abortKeys
+// Description: Drops the open keymap transaction.
+// Arguments:   stepDevice* Step: Pointer to STT device
+// Returns:     libusb result code
+// ----------------------------------------------------------------------------
+int abortKeys(stepDevice* Step);
+
+// ----------------------------------------------------------------------------
+// Function:    readEeprom
+// Description: Reads a range of device EEPROM in STT_EEPROM_CHUNK transfers.
+// Arguments:   stepDevice* Step: Pointer to STT device
+//              uint16_t address: First byte to read
+//               uint8_t* buffer: Destination
+//               uint16_t length: Number of bytes to read
+// Returns:     Number of bytes read or libusb error code
+// ----------------------------------------------------------------------------
+int readEeprom(stepDevice* Step, uint16_t address, uint8_t* buffer, uint16_t length);
+
+// ----------------------------------------------------------------------------
+// Function:    writeEeprom
+// Description: Writes a range of device EEPROM in STT_EEPROM_CHUNK transfers.
+//              The device saves nothing while the range is written and
+//              reloads its configuration afterwards, discarding changes it
+//              had not saved yet.
+// Arguments:   stepDevice* Step: Pointer to STT device
+//              uint16_t address: First byte to write
+//               uint8_t* buffer: Source
+//               uint16_t length: Number of bytes to write
+// Returns:     Number of bytes written or libusb error code
+// ----------------------------------------------------------------------------
+int writeEeprom(stepDevice* Step, uint16_t address, const uint8_t* buffer, uint16_t length);
+
+// ----------------------------------------------------------------------------
+// Function:    backupEeprom
+// Description: Waits for pending changes to reach EEPROM, then reads all of
+//              it.
+// Arguments:   stepDevice* Step: Pointer to STT device
+//                uint8_t* image: STT_EEPROM_SIZE byte destination
+// Returns:     Number of bytes read or libusb error code
+// ----------------------------------------------------------------------------
+int backupEeprom(stepDevice* Step, uint8_t* image);
+
+// ----------------------------------------------------------------------------
+// Function:    restoreEeprom
+// Description: Writes an image taken by backupEeprom, sending only the runs
+//              of bytes that differ from the device. The device keeps its
+//              own oscillator calibration and serial number, or its lack
+//              of one.
+// Arguments:   stepDevice* Step: Pointer to STT device
+//                uint8_t* image: STT_EEPROM_SIZE byte source
+// Returns:     Number of bytes changed or libusb error code
+// ----------------------------------------------------------------------------
+int restoreEeprom(stepDevice* Step, const uint8_t* image);
+
+// ----------------------------------------------------------------------------
+// Function:    updateSetting
+// Description: Stores one device setting in EEPROM.  Settings that change
+//              USB descriptors apply once the device re-enumerates.
+// Arguments:   stepDevice* Step: Pointer to STT device
+//               uint8_t setting: STT_SETTING_* index
+//                 uint8_t value: New value
+// Returns:     libusb result code
+// ----------------------------------------------------------------------------
+int updateSetting(stepDevice* Step, uint8_t setting, uint8_t value);
+
+// ----------------------------------------------------------------------------
+// Function:    getProfile
+// Description: Retrieves the active keymap profile.
+// Arguments:   stepDevice* Step: Pointer to STT device
+//               uint8_t* active: Receives the active profile
+//                uint8_t* count: Receives the number of profiles
+// Returns:     libusb result code
+// ----------------------------------------------------------------------------
+int getProfile(stepDevice* Step, uint8_t* active, uint8_t* count);
+
+// ----------------------------------------------------------------------------
+// Function:    setProfile
+// Description: Switches the device to another keymap profile. Key updates
+//              then apply to that profile. Not saved, the device starts in
+//              profile 0.
+// Arguments:   stepDevice* Step: Pointer to STT device
+//               uint8_t profile: Profile to switch to
+// Returns:     libusb result code
+// ----------------------------------------------------------------------------
+int setProfile(stepDevice* Step, uint8_t profile);
+
+// ----------------------------------------------------------------------------
+// Function:    updateDebounce
+// Description: Sets the debounce window and algorithm for one key and saves
+//              them to EEPROM.  Each key debounces independently.
+// Arguments:   stepDevice* Step: Pointer to STT device
+//                 uint8_t index: Index of key to configure
+//                uint8_t window: Hold-off after each edge in milliseconds
+//                  uint8_t mode: STT_DEBOUNCE_EAGER or STT_DEBOUNCE_DEFERRED
+// Returns:     libusb result code
+// ----------------------------------------------------------------------------
+int updateDebounce(stepDevice* Step, uint8_t index, uint8_t window, uint8_t mode);
+
+// ----------------------------------------------------------------------------
+// Function:    provisionDevices
+// Description: Writes a whole keymap to several devices at once. Every
+//              transfer is submitted before any completes, so the total time
+//              is that of the slowest device rather than the sum. Devices
+//              without STT_CAP_BULK_KEYS are not written and get
+//              LIBUSB_ERROR_NOT_SUPPORTED. If event handling keeps failing
+//              the call gives up and returns that error.
+// Arguments:   stt_provision* jobs: One entry per device, result and
+//                                   elapsedMs are filled in
+//                        int count: Number of entries
+//             unsigned int timeout: Per-device transfer timeout in ms
+// Returns:     Number of devices that failed or libusb error code
+// ----------------------------------------------------------------------------
+int provisionDevices(stt_provision* jobs, int count, unsigned int timeout);
+
+// ----------------------------------------------------------------------------
+// Function:    getDeviceInfoAsync
+// Description: As getDeviceInfo, without blocking. Step->keys,
+//              Step->generation and Step->keysCrc are updated before the
+//              callback runs, see stt_callback for where that happens.
+// Arguments:   stepDevice* Step: Pointer to STT device
+//            unsigned int deadline: Time allowed in ms, 0 for the default
+//            stt_callback callback: Called once on completion, may be NULL
+//                 void* userData: Passed to the callback
+//          stt_request** request: Receives the handle, may be NULL
+// Returns:     libusb result code of the submission
+// ----------------------------------------------------------------------------
+int getDeviceInfoAsync(stepDevice* Step, unsigned int deadline,
+    stt_callback callback, void* userData, stt_request** request);
+
+// ----------------------------------------------------------------------------
+// Function:    updateKeyMappingAsync
+// Description: As updateKeyMapping, without blocking.
+// Arguments:   stepDevice* Step: Pointer to STT device
+//                 uint8_t index: Index of key to update
+//              uint8_t modifier: New modifier for the key
+//              uint8_t scancode: New scancode for the key
+//            unsigned int deadline: Time allowed in ms, 0 for the default
+//            stt_callback callback: Called once on completion, may be NULL
+//                 void* userData: Passed to the callback
+//          stt_request** request: Receives the handle, may be NULL
+// Returns:     libusb result code of the submission
+// ----------------------------------------------------------------------------
+int updateKeyMappingAsync(stepDevice* Step, uint8_t index, uint8_t modifier,
+    uint8_t scancode, unsigned int deadline, stt_callback callback,
+    void* userData, stt_request** request);
+
+// ----------------------------------------------------------------------------
+// Function:    updateAllKeysAsync
+// Description: As updateAllKeys, without blocking. The keys are copied, the
+//              caller's array may change once this returns.
+// Arguments:   stepDevice* Step: Pointer to STT device
+//              stt_keymap* keys: Step->numKeys key assignments, by index
+//            unsigned int deadline: Time allowed in ms, 0 for the default
+//            stt_callback callback: Called once on completion, may be NULL
+//                 void* userData: Passed to the callback
+//          stt_request** request: Receives the handle, may be NULL
+// Returns:     libusb result code of the submission
+// ----------------------------------------------------------------------------
+int updateAllKeysAsync(stepDevice* Step, const stt_keymap* keys,
+    unsigned int deadline, stt_callback callback, void* userData,
+    stt_request** request);
+
+// ----------------------------------------------------------------------------
+// Function:    cancelRequest
+// Description: Asks for a pending request to be abandoned. Its callback
+//              still runs, with LIBUSB_ERROR_INTERRUPTED, from a later
+//              handleEvents. Must not be used once the callback has run.
+// Arguments:   stt_request* request: Handle from one of the *Async calls
+// Returns:     libusb result code
+// ----------------------------------------------------------------------------
+int cancelRequest(stt_request* request);
+
+// ----------------------------------------------------------------------------
+// Function:    getPollFds
+// Description: File descriptors to watch from an external poll, select or
+//              epoll loop. Call handleEvents when any is ready. The set
+//              changes as devices are opened and closed, see
+//              setPollFdNotifiers. Not available on Windows.
+// Arguments:   None
+// Returns:     NULL terminated list, free with libusb_free_pollfds, or NULL
+// ----------------------------------------------------------------------------
+const struct libusb_pollfd** getPollFds(void);
+
+// ----------------------------------------------------------------------------
+// Function:    setPollFdNotifiers
+// Description: Registers functions called when a file descriptor is added
+//              to or removed from the set given by getPollFds.
+// Arguments:   libusb_pollfd_added_cb added: Called for each new descriptor
+//          libusb_pollfd_removed_cb removed: Called for each one removed
+//                          void* userData: Passed to both
+// Returns:     Nothing
+// ----------------------------------------------------------------------------
+void setPollFdNotifiers(libusb_pollfd_added_cb added,
+    libusb_pollfd_removed_cb removed, void* userData);
+
+// ----------------------------------------------------------------------------
+// Function:    getNextTimeout
+// Description: How long an external loop may wait before calling
+//              handleEvents even with nothing ready, so deadlines are met.
+// Arguments:   struct timeval* tv: Receives the time left
+// Returns:     1 if tv was set, 0 if there is no deadline pending, or libusb
+//              error code
+// ----------------------------------------------------------------------------
+int getNextTimeout(struct timeval* tv);
+
+// ----------------------------------------------------------------------------
+// Function:    handleEvents
+// Description: Processes whatever is ready without waiting, running the
+//              callbacks of completed, expired and cancelled requests.
+//              Blocking library calls may run some of them first, see
+//              stt_callback.
+// Arguments:   None
+// Returns:     libusb result code
+// ----------------------------------------------------------------------------
+int handleEvents(void);
+
 #endif
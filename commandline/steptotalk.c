@@ -29,6 +29,393 @@
 #include "steptotalk_lib.h"
 #include "littleWire_util.h"
 
+// ============================================================================
+// OPTIONS
+// ============================================================================
+
+typedef struct {
+    uint8_t showKeyMapping;
+    uint8_t showStatus;
+    int setReportMode;
+    int setSofAlign;
+    int setPollInterval;
+    int setProfileIndex;
+    int setProfileCombo;
+    char *backupFile;
+    char *restoreFile;
+    char *setSerial;
+    char *positional[3];        // modifier, scancode, index
+    int numPositional;
+} cliOptions;
+
+// ============================================================================
+// OPERATION
+// ============================================================================
+
+// Perform the operation selected on the command line on one device
+static int runOperation(stepDevice *Step, const cliOptions *opts) {
+
+    int result = 0;
+
+    if (opts->showStatus) {
+        stt_status status;
+        result = getDeviceStatus(Step, &status);
+        if (result < 0) {
+            printf("Error getting status (#%d): %s", result, libusb_error_name(result));
+        } else {
+            printDeviceStatus(&status);
+        }
+    } else if (opts->setReportMode >= 0) {
+        result = updateSetting(Step, STT_SETTING_REPORT_MODE, opts->setReportMode);
+        if (result < 0) {
+            printf("Error updating report mode (#%d): %s", result, libusb_error_name(result));
+        } else {
+            puts("");
+            puts("     DONE, replug the device to apply");
+            puts("==============================================");
+        }
+    } else if (opts->setSofAlign >= 0) {
+        result = updateSetting(Step, STT_SETTING_SOF_ALIGN, opts->setSofAlign);
+        if (result < 0) {
+            printf("Error updating SOF alignment (#%d): %s", result, libusb_error_name(result));
+        } else {
+            puts("");
+            puts("                    DONE");
+            puts("==============================================");
+        }
+    } else if (opts->setPollInterval >= 0) {
+        result = updateSetting(Step, STT_SETTING_POLL_INTERVAL, opts->setPollInterval);
+        if (result < 0) {
+            printf("Error updating poll interval (#%d): %s", result, libusb_error_name(result));
+        } else {
+            puts("");
+            puts("     DONE, replug the device to apply");
+            puts("==============================================");
+        }
+    } else if (opts->setProfileIndex >= 0) {
+        uint8_t active, count;
+        result = getProfile(Step, &active, &count);
+        if (result >= 0 && opts->setProfileIndex >= count) {
+            printf("\r     Profile must be between 0 and %d       \n", count - 1);
+            return EXIT_FAILURE;
+        } else if (result >= 0) {
+            result = setProfile(Step, opts->setProfileIndex);
+        }
+        if (result < 0) {
+            printf("Error switching profile (#%d): %s", result, libusb_error_name(result));
+        } else {
+            puts("");
+            printf("            Now using profile %d\n", opts->setProfileIndex);
+            puts("==============================================");
+        }
+    } else if (opts->setProfileCombo >= 0) {
+        if (Step->numKeys < 8 && opts->setProfileCombo >= (1 << Step->numKeys)) {
+            printf("\r       Combo mask only covers %d keys       \n", Step->numKeys);
+            return EXIT_FAILURE;
+        }
+        result = updateSetting(Step, STT_SETTING_PROFILE_COMBO, opts->setProfileCombo);
+        if (result < 0) {
+            printf("Error updating profile combo (#%d): %s", result, libusb_error_name(result));
+        } else {
+            puts("");
+            puts("                    DONE");
+            puts("==============================================");
+        }
+    } else if (opts->setSerial != NULL) {
+        if (!(Step->caps.features & STT_CAP_SERIAL)) {
+            printf("\r   Device firmware has a fixed serial number  \n");
+            return EXIT_FAILURE;
+        }
+        result = updateSerial(Step, opts->setSerial);
+        if (result == LIBUSB_ERROR_INVALID_PARAM) {
+            printf("\r  Serial must be 1-%d letters and digits    \n", STT_SERIAL_MAX_LENGTH);
+            return EXIT_FAILURE;
+        } else if (result < 0) {
+            printf("Error updating serial number (#%d): %s", result, libusb_error_name(result));
+        } else {
+            puts("");
+            puts("     DONE, replug the device to apply");
+            puts("==============================================");
+        }
+    } else if (opts->backupFile != NULL) {
+        uint8_t image[STT_EEPROM_SIZE];
+        result = backupEeprom(Step, image);
+        if (result < 0) {
+            printf("Error reading EEPROM (#%d): %s", result, libusb_error_name(result));
+        } else {
+            FILE *file = fopen(opts->backupFile, "wb");
+            if (file == NULL || fwrite(image, 1, result, file) != (size_t)result) {
+                printf("Error writing %s: %s", opts->backupFile, strerror(errno));
+                if (file != NULL) fclose(file);
+                return EXIT_FAILURE;
+            }
+            fclose(file);
+            puts("");
+            printf("          Saved %d bytes of EEPROM\n", result);
+            puts("==============================================");
+        }
+    } else if (opts->restoreFile != NULL) {
+        uint8_t image[STT_EEPROM_SIZE];
+        FILE *file = fopen(opts->restoreFile, "rb");
+        if (file == NULL || fread(image, 1, sizeof(image), file) != sizeof(image)) {
+            printf("Error reading %s: %s", opts->restoreFile,
+                    file == NULL ? strerror(errno) : "not an EEPROM image");
+            if (file != NULL) fclose(file);
+            return EXIT_FAILURE;
+        }
+        fclose(file);
+
+        result = restoreEeprom(Step, image);
+        if (result < 0) {
+            printf("Error writing EEPROM (#%d): %s", result, libusb_error_name(result));
+        } else {
+            puts("");
+            printf("          Restored, %d bytes changed\n", result);
+            puts("==============================================");
+        }
+    } else if (opts->showKeyMapping) {
+        result = getDeviceInfo(Step);    // Get keys (May have changed since initial connect)
+        if (result < 0) {
+            printf("Error getting key map (#%d): %s", result, libusb_error_name(result));
+        } else {
+            printKeyMapping(Step);  // Print out
+        }
+    } else {
+        uint8_t setIndex = 0;
+
+        // If an index is specified, grab it
+        if (opts->numPositional == 3) {
+            setIndex = atoi(opts->positional[2]);
+
+            // Make sure index within known-allowed range
+            if(setIndex >= Step->caps.numKeys) {
+                printf("\r                    ERROR!                  \n");
+                printf("              Index incorrect or\n");
+                printf("          not within acceptable range.\n");
+                return EXIT_FAILURE;
+            }
+        }
+
+        uint8_t setModifier = atoi(opts->positional[0]);
+        uint8_t setScancode = atoi(opts->positional[1]);
+
+        printf("\r               Updating Key #%d              \n", setIndex);
+        printf("               Modifier:  0x%02X\n", setModifier);
+        printf("               Scancode:  0x%02X\n", setScancode);
+
+        result = updateKeyMapping(Step, setIndex, setModifier, setScancode);
+        if (result < 0) {
+            printf("Error updating key map (#%d): %s", result, libusb_error_name(result));
+        } else {
+            puts("");
+            puts("                    DONE");
+            puts("==============================================");
+        }
+
+    }
+
+    return result < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// ============================================================================
+// PROVISIONING
+// ============================================================================
+//
+// A manifest has one device per line: its serial number, then one
+// modifier:scancode pair per key, in key order. '*' matches every device
+// without a line of its own. '#' starts a comment.
+//
+//   # serial   key 0   key 1   key 2
+//   PEDAL01    0:104   0:105   0:106
+//   *          1:4     1:5     1:6
+//
+
+#define MANIFEST_MAX_ENTRIES    64
+#define MANIFEST_MAX_KEYS       16
+
+typedef struct {
+    char serial[32];
+    stt_keymap keys[MANIFEST_MAX_KEYS];
+    int numKeys;
+    int matched;                // Devices this entry was applied to
+} manifestEntry;
+
+// ----------------------------------------------------------------------------
+
+// Read a manifest, returns the number of entries or -1 with a message printed
+static int readManifest(const char *fileName, manifestEntry *entries) {
+
+    char line[256];
+    int count = 0;
+    int lineNumber = 0;
+
+    FILE *file = fopen(fileName, "r");
+    if (file == NULL) {
+        printf("Error reading %s: %s\n", fileName, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        lineNumber++;
+        line[strcspn(line, "#\r\n")] = '\0';
+
+        char *token = strtok(line, " \t");
+        if (token == NULL) continue;
+
+        if (count == MANIFEST_MAX_ENTRIES) {
+            printf("%s:%d: more than %d devices\n", fileName, lineNumber, MANIFEST_MAX_ENTRIES);
+            fclose(file);
+            return -1;
+        }
+
+        manifestEntry *entry = &entries[count];
+        memset(entry, 0, sizeof(*entry));
+        snprintf(entry->serial, sizeof(entry->serial), "%s", token);
+
+        while ((token = strtok(NULL, " \t")) != NULL) {
+            char *end;
+            long modifier = strtol(token, &end, 0);
+            long scancode = *end == ':' ? strtol(end + 1, &end, 0) : -1;
+
+            if (*end != '\0' || modifier < 0 || modifier > 255
+                || scancode < 0 || scancode > 255
+                || entry->numKeys == MANIFEST_MAX_KEYS) {
+                printf("%s:%d: bad key '%s', expected modifier:scancode\n",
+                        fileName, lineNumber, token);
+                fclose(file);
+                return -1;
+            }
+
+            entry->keys[entry->numKeys].modifier = modifier;
+            entry->keys[entry->numKeys].scancode = scancode;
+            entry->numKeys++;
+        }
+
+        if (entry->numKeys == 0) {
+            printf("%s:%d: no keys for %s\n", fileName, lineNumber, entry->serial);
+            fclose(file);
+            return -1;
+        }
+        count++;
+    }
+
+    fclose(file);
+    return count;
+}
+
+// ----------------------------------------------------------------------------
+
+// Write every attached device listed in the manifest at the same time
+static int runProvision(const char *fileName) {
+
+    manifestEntry entries[MANIFEST_MAX_ENTRIES];
+    int result = EXIT_SUCCESS;
+
+    int numEntries = readManifest(fileName, entries);
+    if (numEntries < 0) return EXIT_FAILURE;
+
+    puts("==============================================");
+    puts("          Step-to-Talk Provisioning");
+    puts("==============================================");
+
+    stt_device_info *list;
+    int count = device_list(&list);
+    if (count < 0) {
+        printf("Error listing devices (#%d): %s\n", count, libusb_error_name(count));
+        device_exit();
+        return EXIT_FAILURE;
+    }
+
+    stt_provision *jobs = calloc(count ? count : 1, sizeof(stt_provision));
+    int numJobs = 0;
+
+    for (int i = 0; i < count && jobs != NULL; i++) {
+        manifestEntry *entry = NULL;
+
+        for (int e = 0; e < numEntries; e++) {
+            if (strcmp(entries[e].serial, list[i].serial) == 0) {
+                entry = &entries[e];
+                break;
+            } else if (strcmp(entries[e].serial, "*") == 0 && entry == NULL) {
+                entry = &entries[e];
+            }
+        }
+
+        if (entry == NULL) {
+            printf("  %-10s %-10s not in manifest, skipped\n", list[i].serial, list[i].path);
+            continue;
+        }
+        entry->matched++;
+
+        // A device that does not answer must not hold up the others
+        stepDevice *Step = device_connect_info(&list[i], PROVISION_TIMEOUT);
+        if (Step == NULL) {
+            printf("  %-10s %-10s could not be opened\n", list[i].serial, list[i].path);
+            result = EXIT_FAILURE;
+            continue;
+        }
+
+        if (Step->numKeys != entry->numKeys) {
+            printf("  %-10s %-10s has %d keys, manifest gives %d\n",
+                    Step->serial, Step->path, Step->numKeys, entry->numKeys);
+            device_close(Step);
+            result = EXIT_FAILURE;
+            continue;
+        }
+
+        jobs[numJobs].Step = Step;
+        jobs[numJobs].keys = entry->keys;
+        numJobs++;
+    }
+
+    for (int e = 0; e < numEntries; e++) {
+        if (!entries[e].matched && strcmp(entries[e].serial, "*") != 0) {
+            printf("  %-10s not attached\n", entries[e].serial);
+            result = EXIT_FAILURE;
+        }
+    }
+
+    // Send to every device at once -------------------------------------------
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int failed = provisionDevices(jobs, numJobs, PROVISION_TIMEOUT);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (failed < 0) {
+        printf("Error provisioning (#%d): %s\n", failed, libusb_error_name(failed));
+        result = EXIT_FAILURE;
+    }
+
+    for (int j = 0; j < numJobs && failed >= 0; j++) {
+        if (jobs[j].result == LIBUSB_ERROR_NOT_SUPPORTED) {
+            printf("  %-10s %-10s firmware too old for provisioning, skipped\n",
+                    jobs[j].Step->serial, jobs[j].Step->path);
+            result = EXIT_FAILURE;
+        } else if (jobs[j].result < 0) {
+            printf("  %-10s %-10s FAILED %s after %u ms\n", jobs[j].Step->serial,
+                    jobs[j].Step->path, libusb_error_name(jobs[j].result), jobs[j].elapsedMs);
+            result = EXIT_FAILURE;
+        } else {
+            printf("  %-10s %-10s done in %u ms\n", jobs[j].Step->serial,
+                    jobs[j].Step->path, jobs[j].elapsedMs);
+        }
+    }
+
+    puts("==============================================");
+    printf("     %d of %d devices in %ld ms\n", failed >= 0 ? numJobs - failed : 0, numJobs,
+            (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000);
+    puts("==============================================");
+
+    for (int j = 0; j < numJobs; j++) {
+        device_close(jobs[j].Step);
+    }
+    free(jobs);
+    device_list_free(list);
+    device_exit();
+
+    return result;
+}
+
 // ============================================================================
 // MAIN
 // ============================================================================
@@ -39,11 +426,27 @@ int main(int argc, char **argv) {
     setbuf(stdout, NULL);
 
     // Defaults
-    uint8_t showKeyMapping  = 0;
-    uint8_t setIndex        = 0;
-    uint8_t setModifier     = 0;
-    uint8_t setScancode     = 0;
-    int result              = 0;
+    cliOptions opts = {
+        .setReportMode      = -1,
+        .setSofAlign        = -1,
+        .setPollInterval    = -1,
+        .setProfileIndex    = -1,
+        .setProfileCombo    = -1,
+    };
+    uint8_t listDevices     = 0;
+    uint8_t allDevices      = 0;
+    char *selectSerial      = NULL;
+    char *selectPath        = NULL;
+    int result              = EXIT_SUCCESS;
+
+    // Provisioning takes a manifest and nothing else
+    if (argc >= 2 && strcmp(argv[1], "provision") == 0) {
+        if (argc != 3) {
+            puts(STEPTOTALK_USAGE);
+            return EXIT_FAILURE;
+        }
+        return runProvision(argv[2]);
+    }
 
     // Parse arguments --------------------------------------------------------
     int arg_pointer = 1;
@@ -53,74 +456,179 @@ int main(int argc, char **argv) {
             printHelp();
             return EXIT_SUCCESS;
         } else if (strcmp(argv[arg_pointer], "--show") == 0 || strcmp(argv[arg_pointer], "-s") == 0) {
-            showKeyMapping = 1;
-        } else {
+            opts.showKeyMapping = 1;
+        } else if (strcmp(argv[arg_pointer], "--status") == 0) {
+            opts.showStatus = 1;
+        } else if (strcmp(argv[arg_pointer], "--report-mode") == 0 && arg_pointer + 1 < argc) {
+            arg_pointer++;
+            if (strcmp(argv[arg_pointer], "array") == 0) {
+                opts.setReportMode = STT_REPORT_MODE_ARRAY;
+            } else if (strcmp(argv[arg_pointer], "nkro") == 0) {
+                opts.setReportMode = STT_REPORT_MODE_NKRO;
+            } else {
+                puts(STEPTOTALK_USAGE);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[arg_pointer], "--sof-align") == 0 && arg_pointer + 1 < argc) {
+            arg_pointer++;
+            if (strcmp(argv[arg_pointer], "on") == 0) {
+                opts.setSofAlign = 1;
+            } else if (strcmp(argv[arg_pointer], "off") == 0) {
+                opts.setSofAlign = 0;
+            } else {
+                puts(STEPTOTALK_USAGE);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[arg_pointer], "--poll-interval") == 0 && arg_pointer + 1 < argc) {
+            arg_pointer++;
+            opts.setPollInterval = atoi(argv[arg_pointer]);
+            if (opts.setPollInterval < 1 || opts.setPollInterval > 254) {
+                puts(STEPTOTALK_USAGE);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[arg_pointer], "--profile") == 0 && arg_pointer + 1 < argc) {
+            arg_pointer++;
+            opts.setProfileIndex = atoi(argv[arg_pointer]);
+            if (opts.setProfileIndex < 0 || opts.setProfileIndex > 255) {
+                puts(STEPTOTALK_USAGE);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[arg_pointer], "--profile-combo") == 0 && arg_pointer + 1 < argc) {
+            arg_pointer++;
+            opts.setProfileCombo = atoi(argv[arg_pointer]);
+            if (opts.setProfileCombo < 0 || opts.setProfileCombo > 255) {
+                puts(STEPTOTALK_USAGE);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[arg_pointer], "--backup") == 0 && arg_pointer + 1 < argc) {
+            opts.backupFile = argv[++arg_pointer];
+        } else if (strcmp(argv[arg_pointer], "--restore") == 0 && arg_pointer + 1 < argc) {
+            opts.restoreFile = argv[++arg_pointer];
+        } else if (strcmp(argv[arg_pointer], "--set-serial") == 0 && arg_pointer + 1 < argc) {
+            opts.setSerial = argv[++arg_pointer];
+        } else if (strcmp(argv[arg_pointer], "--list") == 0) {
+            listDevices = 1;
+        } else if (strcmp(argv[arg_pointer], "--serial") == 0 && arg_pointer + 1 < argc) {
+            selectSerial = argv[++arg_pointer];
+        } else if (strcmp(argv[arg_pointer], "--path") == 0 && arg_pointer + 1 < argc) {
+            selectPath = argv[++arg_pointer];
+        } else if (strcmp(argv[arg_pointer], "--all") == 0) {
+            allDevices = 1;
+        } else if (opts.numPositional < 3) {
             // Reaching here: Passed CLI arguments should
             // only be modifiers, scancodes, indices
+            opts.positional[opts.numPositional++] = argv[arg_pointer];
+        } else {
+            puts(STEPTOTALK_USAGE);
+            return EXIT_FAILURE;
         }
 
         arg_pointer++;
     }
 
-    // Too few arguments, fail and print usage
-    if (argc < 2) {
+    // Too few arguments, or a device picked more than one way
+    if (argc < 2 || (selectSerial != NULL) + (selectPath != NULL) + allDevices > 1) {
         puts(STEPTOTALK_USAGE);
         return EXIT_FAILURE;
     }
 
-    // Get and connect to device ----------------------------------------------
+    // runOperation does one thing per device, anything more would be
+    // silently ignored
+    int numOperations = listDevices + opts.showKeyMapping + opts.showStatus
+        + (opts.setReportMode >= 0) + (opts.setSofAlign >= 0)
+        + (opts.setPollInterval >= 0) + (opts.setProfileIndex >= 0)
+        + (opts.setProfileCombo >= 0) + (opts.setSerial != NULL)
+        + (opts.backupFile != NULL) + (opts.restoreFile != NULL)
+        + (opts.numPositional > 0);
+    if (numOperations > 1) {
+        puts("Only one operation can be given at a time");
+        puts(STEPTOTALK_USAGE);
+        return EXIT_FAILURE;
+    }
+
+    // A key update needs at least a modifier and a scancode
+    if (numOperations == 0 || opts.numPositional == 1) {
+        puts(STEPTOTALK_USAGE);
+        return EXIT_FAILURE;
+    }
+
+    // Serial numbers are meant to tell devices apart
+    if (allDevices && opts.setSerial != NULL) {
+        puts("--set-serial cannot be used with --all");
+        return EXIT_FAILURE;
+    }
+
     puts("==============================================");
     puts("               Step-to-Talk CLI");
     puts("==============================================");
-    printf("\r            Waiting for the device...        ");
 
-    while (Step == NULL) {
-        delay(100);
-        Step = device_connect();
-    }
-    printf("\r                 Device found!               ");
+    // List or pick from attached devices -------------------------------------
+    if (listDevices || selectPath != NULL || allDevices) {
+        stt_device_info *list;
+        int count = device_list(&list);
 
-    // Perform specified operation --------------------------------------------
-    if (showKeyMapping) {
-        result = getDeviceInfo(Step);    // Get keys (May have changed since initial connect)
-        if (result < 0) {
-            printf("Error getting key map (#%d): %s", result, libusb_error_name(result));
-        } else {
-            printKeyMapping(Step);  // Print out
+        if (count < 0) {
+            printf("Error listing devices (#%d): %s\n", count, libusb_error_name(count));
+            device_exit();
+            return EXIT_FAILURE;
         }
-    } else {
-
-        // If an index is specified, grab it
-        if (argc == 4) {
-            setIndex = atoi(argv[3]);
 
-            // Make sure index within known-allowed range
-            if(setIndex > STT_MAX_KEY_INDEX || setIndex < STT_MIN_KEY_INDEX) {
-                printf("\r                    ERROR!                  \n");
-                printf("              Index incorrect or\n");
-                printf("          not within acceptable range.\n");
-                return EXIT_FAILURE;
+        if (listDevices) {
+            printf("  %-10s %-10s %s\n", "Serial", "Path", "Version");
+            for (int i = 0; i < count; i++) {
+                printf("  %-10s %-10s %d.%d\n", list[i].serial, list[i].path,
+                        list[i].version.major, list[i].version.minor);
             }
+            if (count == 0) puts("            No devices attached");
+            puts("==============================================");
+        } else if (count == 0) {
+            puts("            No devices attached");
+            result = EXIT_FAILURE;
         }
 
-        setModifier = atoi(argv[1]);
-        setScancode = atoi(argv[2]);
+        int matched = 0;
+        for (int i = 0; i < count && !listDevices; i++) {
+            if (selectPath != NULL && strcmp(list[i].path, selectPath) != 0) continue;
+            matched++;
 
-        printf("\r               Updating Key #%d              \n", setIndex);
-        printf("               Modifier:  0x%02X\n", setModifier);
-        printf("               Scancode:  0x%02X\n", setScancode);
+            Step = device_connect_info(&list[i], 0);
+            if (Step == NULL) {
+                printf("\r  Could not open device %s at %s\n", list[i].serial, list[i].path);
+                result = EXIT_FAILURE;
+                continue;
+            }
+            printf("\r          Device %s at %s\n", Step->serial, Step->path);
 
-        int result = updateKeyMapping(Step, setIndex, setModifier, setScancode);
-        if (result < 0) {
-            printf("Error updating key map (#%d): %s", result, libusb_error_name(result));
-        } else {
+            if (runOperation(Step, &opts) != EXIT_SUCCESS) result = EXIT_FAILURE;
+            device_close(Step);
             puts("");
-            puts("                    DONE");
-            puts("==============================================");
+
+            if (selectPath != NULL) break;
+        }
+
+        if (selectPath != NULL && !matched && count > 0) {
+            printf("            No device at path %s\n", selectPath);
+            result = EXIT_FAILURE;
         }
 
+        device_list_free(list);
+        device_exit();
+        return result;
     }
 
-    return EXIT_SUCCESS;
-}
+    // Get and connect to device ----------------------------------------------
+    printf("\r            Waiting for the device...        ");
 
+    // Blocks until the device appears, unless hotplug is unavailable
+    while ((Step = device_connect_serial(selectSerial, 0)) == NULL) {
+        delay(100);
+    }
+    printf("\r                 Device found!               ");
+
+    // Perform specified operation --------------------------------------------
+    result = runOperation(Step, &opts);
+
+    device_close(Step);
+    device_exit();
+    return result;
+}
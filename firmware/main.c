@@ -24,6 +24,9 @@
 #include <avr/pgmspace.h>
 #include <util/delay.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <util/crc16.h>
 
 #include "usbdrv.h"
 #include "oddebug.h"
@@ -40,39 +43,247 @@
 #define IO_SW2          PB1         // Switches
 #define IO_SW3          PB2         //
 
-const uchar             SW[3] = {IO_SW1, IO_SW2, IO_SW3};
+// Switches sit on the low pins so that PINB bit n is key n
+#define IO_SW_MASK      (_BV(IO_SW1) | _BV(IO_SW2) | _BV(IO_SW3))
+
+#if IO_SW1 != 0 || IO_SW2 != 1 || IO_SW3 != 2
+#error "Debounce engine expects switches on PB0, PB1 and PB2"
+#endif
 
 // Define keys
 #define NUM_KEYS            3               // Number of keys
 #define NUM_TOTAL_KEYS      NUM_KEYS * 2    // Each key + modifier
-#define SAVE_EEPROM_OFFSET  12              // Where to begin saving
 
-static uchar    buttonState[NUM_KEYS]   = {0};  // Store button states
-static uchar    buttonStateChanged      = 0;    // Button edge detect
+static uchar    buttonState             = 0;    // Debounced states, bit n = key n
+static uchar    buttonChanged           = 0;    // Keys changed since last report
 
 typedef struct {
     uint8_t modifier;
     uint8_t scancode;
 } keymap_t;
 
-//  |                       savedKeys = 6 Bytes                       |
+//  |                     keyStore.keys = 6 Bytes                     |
 //  |         SW1         |         SW2         |         SW3         |
 //  |       keymap_t      |       keymap_t      |       keymap_t      |
 //  |  1 Byte  |  1 Byte  |  1 Byte  |  1 Byte  |  1 Byte  |  1 Byte  |
 //  | Modifier | Scancode | Modifier | Scancode | Modifier | Scancode |
+//
+// The keymap in RAM is authoritative and saved with the rest of the
+// configuration, see EEPROM RECORD STORE. Every change bumps the generation.
+// GET_KEY returns the keys followed by the generation and a CRC-16 of the
+// keys so hosts can tell when a cached copy is stale. Volatile changes are
+// not saved, so after a power cycle the generation can count up from an
+// older value again; the CRC tells such keymaps apart.
+
+typedef struct {
+    keymap_t keys[NUM_KEYS];
+    uint16_t generation;                        // Bumped on every change
+    uint16_t crc;                               // CRC-16 of keys
+} keyStore_t;
+
+keyStore_t keyStore;
+
+// Several keymaps are kept and saved, keyStore.keys caches the active one.
+// Switching profiles only touches RAM and is not saved, the device always
+// starts in profile 0.
+#define NUM_PROFILES        4
+
+static keymap_t keyProfiles[NUM_PROFILES][NUM_KEYS];
+static uchar    activeProfile;
+static uchar    profileHeld;                    // Combo keys swallowed until released
+
+// SET_KEYS_VOLATILE changes keyStore.keys alone, leaving the profile and
+// EEPROM as they were until PERSIST_KEYS. Resets and profile switches go
+// back to the stored map.
+static uchar    keyOverride;                    // keyStore.keys differs from profile
+
+// ----------------------------------------------------------------------------
+// DEBOUNCE
+// ----------------------------------------------------------------------------
+
+#define DEBOUNCE_EAGER          0   // Report edge at once, then hold for window
+#define DEBOUNCE_DEFERRED       1   // Report edge once stable for window
+
+#define DEBOUNCE_DEFAULT_MS     50  // Window used on blank EEPROM
+#define DEBOUNCE_BITS           7   // Bit planes of the window counters
+#define DEBOUNCE_MAX_MS         127 // Longest window DEBOUNCE_BITS can count
+
+typedef struct {
+    uint8_t window;                 // Debounce window in milliseconds
+    uint8_t mode;                   // DEBOUNCE_EAGER or DEBOUNCE_DEFERRED
+} debounce_t;
 
-keymap_t savedKeys[NUM_KEYS];
+//  |                   debounceConfig = 6 Bytes                      |
+//  |         SW1         |         SW2         |         SW3         |
+//  |     debounce_t      |     debounce_t      |     debounce_t      |
+//  |  1 Byte  |  1 Byte  |  1 Byte  |  1 Byte  |  1 Byte  |  1 Byte  |
+//  |  Window  |   Mode   |  Window  |   Mode   |  Window  |   Mode   |
+
+debounce_t debounceConfig[NUM_KEYS];
+
+static uchar    debounceEagerMask;              // Keys using DEBOUNCE_EAGER
+static uchar    debounceWindow[DEBOUNCE_BITS];  // Bit planes of each key's window
+static uchar    debounceCount[DEBOUNCE_BITS];   // Bit planes of ms left per key
 
 // ----------------------------------------------------------------------------
 // USB
 // ----------------------------------------------------------------------------
 
-#define STEPTOTALK_GET_KEY   0
-#define STEPTOTALK_SET_KEY   1
+#define STEPTOTALK_GET_KEY          0
+#define STEPTOTALK_SET_KEY          1
+#define STEPTOTALK_GET_DEBOUNCE     2
+#define STEPTOTALK_SET_DEBOUNCE     3
+#define STEPTOTALK_GET_STATUS       4
+#define STEPTOTALK_GET_SETTINGS     5
+#define STEPTOTALK_SET_SETTING      6
+#define STEPTOTALK_SET_ALL_KEYS     7
+#define STEPTOTALK_READ_EEPROM      8
+#define STEPTOTALK_WRITE_EEPROM     9
+#define STEPTOTALK_BEGIN_KEYS       10
+#define STEPTOTALK_STAGE_KEY        11
+#define STEPTOTALK_COMMIT_KEYS      12
+#define STEPTOTALK_ABORT_KEYS       13
+#define STEPTOTALK_GET_PROFILE      14
+#define STEPTOTALK_SET_PROFILE      15
+#define STEPTOTALK_SET_KEYS_VOLATILE 16
+#define STEPTOTALK_PERSIST_KEYS     17
+#define STEPTOTALK_GET_CAPS         18
+#define STEPTOTALK_SET_SERIAL       19
+
+// Report formats, selected by SETTING_REPORT_MODE at enumeration
+#define REPORT_MODE_ARRAY   0                   // Modifiers and one slot per key
+#define REPORT_MODE_NKRO    1                   // Bitmap of every keyboard usage
+
+#define REPORT_SIZE         (NUM_KEYS + 1)      // Add 1 byte for modifier
+#define REPORT_MAX_SIZE     8                   // Low speed interrupt packet
+
+// A full usage bitmap does not fit one low speed packet, so the NKRO report
+// is split over report IDs 1 to NKRO_CHUNKS carrying 56 usages each. The
+// last chunk holds usages 0xE0 to 0xE7, the modifier bits.
+#define NKRO_USAGE_COUNT    0xE8                // Usages 0x00 to 0xE7
+#define NKRO_CHUNK_BITS     56                  // Bits after the report ID
+#define NKRO_CHUNKS         ((NKRO_USAGE_COUNT + NKRO_CHUNK_BITS - 1) / NKRO_CHUNK_BITS)
+#define NKRO_MOD_CHUNK      (NKRO_CHUNKS - 1)
+#define NKRO_REPORT_SIZE    8
+
+static uchar    reportMode;                     // Mode enumerated with
+
+#define reportSize()        (reportMode == REPORT_MODE_NKRO ? NKRO_REPORT_SIZE : REPORT_SIZE)
+
+// Reports are written to the back buffer and published by flipping
+// reportFront, so GET_REPORT, idle repeats and interrupt-IN only ever see a
+// complete report without having to disable interrupts
+static uchar            reportBuffer[2][REPORT_MAX_SIZE];
+static volatile uchar   reportFront;            // Index of committed report
+
+#define reportCommitted()   (reportBuffer[reportFront])
 
-static uchar    reportBuffer[NUM_KEYS + 1];     // Buffer for HID reports
-                                                // Add 1 byte for modifier
 static uchar    idleRate;                       // In 4 ms units
+static uchar    idleCounter;                    // 4 ms units since last report
+
+// Precomputed reports for every button state, too large beyond a few keys
+#define REPORT_TABLE        (NUM_KEYS <= 4)
+#define REPORT_TABLE_SIZE   (1 << NUM_KEYS)
+
+#if REPORT_TABLE
+static uchar    reportTable[REPORT_TABLE_SIZE][REPORT_SIZE];
+#endif
+
+// Button states waiting for a free interrupt-IN slot, one report each
+#define REPORT_QUEUE_SIZE   8                   // Must be a power of two
+#define REPORT_QUEUE_MASK   (REPORT_QUEUE_SIZE - 1)
+
+static uchar    reportQueue[REPORT_QUEUE_SIZE];
+static uchar    reportQueueHead;                // Next slot to fill
+static uchar    reportQueueTail;                // Next slot to send
+static uchar    reportQueueLast;                // Newest queued or sent state
+
+// NKRO reports still to send for the state taken off the queue
+static uchar    nkroState;                      // Button state being reported
+static uchar    nkroPending;                    // Chunks left to send, bit n = ID n+1
+static uchar    nkroPressing;                   // State added keys, modifiers go first
+static uchar    nkroKeyChunks[NUM_KEYS];        // Chunks each key's usages fall in
+static uchar    nkroUsedChunks;                 // Chunks any key can change
+static uchar    nkroGetReport[NKRO_REPORT_SIZE];// GET_REPORT scratch buffer
+
+// Device status, read by the host with STEPTOTALK_GET_STATUS
+typedef struct {
+    uint16_t reportOverflows;                   // Reports merged on full queue
+    uint8_t  sofCount;                          // usbSofCount when status was read
+    uint8_t  pickupFrame;                       // usbSofCount at last report pickup
+    uint8_t  pickupLatency;                     // Frames from arming to pickup
+    uint8_t  pollPeriod;                        // Frames between back-to-back pickups
+    uint8_t  persistPending;                    // 1 while a record awaits EEPROM
+} status_t;
+
+static status_t status;
+
+#if USB_COUNT_SOF
+static uchar    reportArmed;                    // Interrupt-IN holds a report
+static uchar    reportArmedFrame;               // usbSofCount when it was armed
+#endif
+
+// Serial number string descriptor, served from RAM so every unit can carry
+// its own serial from EEPROM. Blank units use USB_CFG_SERIAL_NUMBER.
+#define SERIAL_MAX_LENGTH   8                   // Characters
+#define SERIAL_EEPROM_OFFSET 1                  // Unused by the legacy layout
+
+static int      serialDescriptor[1 + SERIAL_MAX_LENGTH];
+static uchar    serialStored;                   // Serial came from EEPROM, not the fallback
+
+// Data stage of the vendor request being received by usbFunctionWrite(),
+// staged so that an aborted transfer changes nothing
+#define WRITE_BUFFER_SIZE   (NUM_TOTAL_KEYS > SERIAL_MAX_LENGTH \
+                                ? NUM_TOTAL_KEYS : SERIAL_MAX_LENGTH)
+
+static uchar    writeRequest;                   // bRequest the data belongs to
+static uchar    writeOffset;                    // Bytes received so far
+static uchar    writeLength;                    // Bytes expected
+static uchar    writeBuffer[WRITE_BUFFER_SIZE];
+
+// Raw EEPROM streamed by usbFunctionRead() and usbFunctionWrite()
+#define EEPROM_SIZE         (E2END + 1)
+
+static uint16_t eepromAddress;                  // Next byte to transfer
+static uchar    eepromRemaining;                // Bytes left in the transfer
+
+// A restore spans many WRITE_EEPROM transfers. Records are not written in
+// between, and configuration is only reloaded once the last one arrives.
+#define EEPROM_WRITE_LAST   0x01                // wValue flag, end of restore
+
+static uchar    eepromRestoring;                // Restore started, persistPoll paused
+static uchar    eepromWriteLast;                // This transfer ends the restore
+
+// Keymap transaction: BEGIN copies the live keymap, STAGE_KEY edits the copy
+// and COMMIT_KEYS makes it live as a whole, saved in a single record. Commit
+// is refused if the transaction saw a bad key or the live keymap changed
+// since BEGIN, nothing staged is visible until then.
+#define STAGE_IDLE          0
+#define STAGE_OPEN          1
+#define STAGE_FAILED        2                   // Open, but commit will be refused
+
+static uchar    stageState;
+static uint16_t stageGeneration;                // keyStore.generation at BEGIN
+static keymap_t stageKeys[NUM_KEYS];
+static uchar    stageCommitted;                 // COMMIT_KEYS reply, 1 if live
+
+// ----------------------------------------------------------------------------
+// SETTINGS
+// ----------------------------------------------------------------------------
+
+#define SETTING_REPORT_MODE     0
+#define SETTING_SOF_ALIGN       1
+#define SETTING_POLL_INTERVAL   2
+#define SETTING_PROFILE_COMBO   3
+
+typedef struct {
+    uint8_t reportMode;                         // REPORT_MODE_ARRAY or _NKRO
+    uint8_t sofAlign;                           // Lock sampling to USB frames
+    uint8_t pollInterval;                       // Interrupt-IN interval in ms
+    uint8_t profileCombo;                       // Keys that cycle profiles, 0 = off
+} settings_t;
+
+settings_t settings;
 
 // ----------------------------------------------------------------------------
 // KEYBOARD MODIFIER KEYS
@@ -105,45 +316,688 @@ PROGMEM char usbHidReportDescriptor[USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH] = {
     0xc0                            // END_COLLECTION
 };
 
+#define NKRO_REPORT_DESCRIPTOR_LENGTH   63
+
+PROGMEM const char nkroReportDescriptor[NKRO_REPORT_DESCRIPTOR_LENGTH] = {
+    0x05, 0x01,                     // USAGE_PAGE (Generic Desktop)
+    0x09, 0x06,                     // USAGE (Keyboard)
+    0xa1, 0x01,                     // COLLECTION (Application)
+    0x05, 0x07,                     //   USAGE_PAGE (Keyboard)
+    0x15, 0x00,                     //   LOGICAL_MINIMUM (0)
+    0x25, 0x01,                     //   LOGICAL_MAXIMUM (1)
+    0x75, 0x01,                     //   REPORT_SIZE (1)
+    0x95, 0x38,                     //   REPORT_COUNT (56)
+    0x85, 0x01,                     //   REPORT_ID (1)
+    0x19, 0x00,                     //   USAGE_MINIMUM (0x00)
+    0x29, 0x37,                     //   USAGE_MAXIMUM (0x37)
+    0x81, 0x02,                     //   INPUT (Data,Var,Abs)
+    0x85, 0x02,                     //   REPORT_ID (2)
+    0x19, 0x38,                     //   USAGE_MINIMUM (0x38)
+    0x29, 0x6f,                     //   USAGE_MAXIMUM (0x6F)
+    0x81, 0x02,                     //   INPUT (Data,Var,Abs)
+    0x85, 0x03,                     //   REPORT_ID (3)
+    0x19, 0x70,                     //   USAGE_MINIMUM (0x70)
+    0x29, 0xa7,                     //   USAGE_MAXIMUM (0xA7)
+    0x81, 0x02,                     //   INPUT (Data,Var,Abs)
+    0x85, 0x04,                     //   REPORT_ID (4)
+    0x19, 0xa8,                     //   USAGE_MINIMUM (0xA8)
+    0x29, 0xdf,                     //   USAGE_MAXIMUM (0xDF)
+    0x81, 0x02,                     //   INPUT (Data,Var,Abs)
+    0x85, 0x05,                     //   REPORT_ID (5)
+    0x95, 0x08,                     //   REPORT_COUNT (8)
+    0x19, 0xe0,                     //   USAGE_MINIMUM (Keyboard LeftControl)
+    0x29, 0xe7,                     //   USAGE_MAXIMUM (Keyboard Right GUI)
+    0x81, 0x02,                     //   INPUT (Data,Var,Abs)
+    0x95, 0x30,                     //   REPORT_COUNT (48)
+    0x81, 0x03,                     //   INPUT (Cnst,Var,Abs)
+    0xc0                            // END_COLLECTION
+};
+
+// ----------------------------------------------------------------------------
+
+// Served from RAM so the HID descriptor can name the report descriptor of
+// the mode chosen at enumeration, and the endpoint the stored poll interval
+#define CONFIG_DESCR_HID_OFFSET     18
+#define CONFIG_DESCR_REPORT_LENGTH  25
+#define CONFIG_DESCR_POLL_INTERVAL  33
+
+static uchar configDescriptor[] = {
+    9,                              // sizeof(usbDescrConfig)
+    USBDESCR_CONFIG,                // Descriptor type
+    34, 0,                          // Total length including inlined descriptors
+    1,                              // Number of interfaces
+    1,                              // Index of this configuration
+    0,                              // Configuration name string index
+    (1 << 7),                       // Attributes: bus powered
+    USB_CFG_MAX_BUS_POWER / 2,      // Max USB current in 2 mA units
+
+    9,                              // sizeof(usbDescrInterface)
+    USBDESCR_INTERFACE,             // Descriptor type
+    0,                              // Index of this interface
+    0,                              // Alternate setting
+    1,                              // Endpoints excluding 0
+    USB_CFG_INTERFACE_CLASS,
+    USB_CFG_INTERFACE_SUBCLASS,
+    USB_CFG_INTERFACE_PROTOCOL,
+    0,                              // Interface string index
+
+    9,                              // sizeof(usbDescrHID)
+    USBDESCR_HID,                   // Descriptor type
+    0x01, 0x01,                     // HID version (BCD)
+    0x00,                           // Country code
+    0x01,                           // Number of descriptors to follow
+    0x22,                           // Descriptor type: report
+    USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH, 0,    // Report descriptor length
+
+    7,                              // sizeof(usbDescrEndpoint)
+    USBDESCR_ENDPOINT,              // Descriptor type
+    0x81,                           // IN endpoint number 1
+    0x03,                           // Attributes: interrupt endpoint
+    8, 0,                           // Maximum packet size
+    USB_CFG_INTR_POLL_INTERVAL,     // Poll interval in ms
+};
+
 // ============================================================================
 // KEYBOARD ACTIONS
 // ============================================================================
 
-static void usbSendScanCode(uchar modifier, uchar keys[]) {
-    reportBuffer[0] = modifier;
-    reportBuffer[1] = keys[0];
-    reportBuffer[2] = keys[1];
-    reportBuffer[3] = keys[2];
+// Build the report for one combination of pressed keys
+static void buildReport(uchar state, uchar *report) {
+
+    uchar modOut = 0;
+
+    for (uchar i = 0; i < NUM_KEYS; i++) {
+
+        if (state & _BV(i)) {
+            // Press
+            report[i + 1] = keyStore.keys[i].scancode;
+
+            if (keyStore.keys[i].modifier != MOD_NONE) {
+                modOut |= keyStore.keys[i].modifier;
+            }
+        } else {
+            // Release, but only if a key was specified
+            if (keyStore.keys[i].scancode == 0) {
+                report[i + 1] = 0;
+            } else {
+                report[i + 1] = 0x80 | keyStore.keys[i].scancode;
+            }
+        }
+    }
+
+    report[0] = modOut;
+}
+
+// ----------------------------------------------------------------------------
+
+static void nkroSetUsage(uchar *report, uchar chunk, uchar usage) {
+
+    uchar bit = usage - chunk * NKRO_CHUNK_BITS;
+
+    // Wraps past NKRO_CHUNK_BITS for usages below this chunk
+    if (bit < NKRO_CHUNK_BITS && usage < NKRO_USAGE_COUNT) {
+        report[1 + (bit >> 3)] |= _BV(bit & 7);
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+// Build one chunk of the NKRO bitmap for a combination of pressed keys
+static void buildNkroReport(uchar state, uchar chunk, uchar *report) {
+
+    report[0] = chunk + 1;
+    memset(report + 1, 0, NKRO_REPORT_SIZE - 1);
+
+    for (uchar i = 0; i < NUM_KEYS; i++) {
+        if (state & _BV(i)) {
+            if (keyStore.keys[i].scancode != 0) {
+                nkroSetUsage(report, chunk, keyStore.keys[i].scancode);
+            }
+
+            // Modifier bits line up with usages 0xE0 to 0xE7
+            if (chunk == NKRO_MOD_CHUNK) {
+                report[1] |= keyStore.keys[i].modifier;
+            }
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+// Every report the keys can produce, indexed by button state, and the NKRO
+// chunks each key touches. Must be rebuilt whenever the keymap changes.
+static void buildReportTable(void) {
+#if REPORT_TABLE
+    for (uchar state = 0; state < REPORT_TABLE_SIZE; state++) {
+        buildReport(state, reportTable[state]);
+    }
+#endif
+
+    // Chunks the old map reported into may still show a held key's old
+    // usage or modifiers, resend them from the current state
+    if (reportMode == REPORT_MODE_NKRO) {
+        nkroPending |= nkroUsedChunks;
+    }
+
+    nkroUsedChunks = 0;
+    for (uchar i = 0; i < NUM_KEYS; i++) {
+        uchar chunks = 0;
+        if (keyStore.keys[i].scancode != 0 && keyStore.keys[i].scancode < NKRO_USAGE_COUNT) {
+            chunks |= _BV(keyStore.keys[i].scancode / NKRO_CHUNK_BITS);
+        }
+        if (keyStore.keys[i].modifier != MOD_NONE) {
+            chunks |= _BV(NKRO_MOD_CHUNK);
+        }
+        nkroKeyChunks[i] = chunks;
+        nkroUsedChunks |= chunks;
+    }
+
+    // And the ones the new map reports a held key in
+    if (reportMode == REPORT_MODE_NKRO) {
+        nkroPending |= nkroUsedChunks;
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+static void reportArm(void) {
+    usbSetInterrupt(reportCommitted(), reportSize());
+
+#if USB_COUNT_SOF
+    reportArmed = 1;
+    reportArmedFrame = usbSofCount;
+#endif
+}
+
+// ----------------------------------------------------------------------------
+
+#if USB_COUNT_SOF
+// Watch for the host collecting an armed report. Back-to-back pickups give
+// the host's real poll period in frames, which with the pickup frame tells
+// where in the frame count the next poll will land. Both are only measured
+// for GET_STATUS; reports are still armed as soon as they are ready.
+static void reportPickupPoll(void) {
+
+    if (reportArmed && usbInterruptIsReady()) {
+        uchar frame = usbSofCount;
+
+        status.pickupLatency = frame - reportArmedFrame;
+        if (reportArmedFrame == status.pickupFrame) {
+            status.pollPeriod = frame - status.pickupFrame;
+        }
+        status.pickupFrame = frame;
+        reportArmed = 0;
+    }
+}
+#endif
+
+// ----------------------------------------------------------------------------
+
+static void usbSendScanCodes(uchar state, uchar chunk) {
+
+    uchar back = reportFront ^ 1;
+
+    if (reportMode == REPORT_MODE_NKRO) {
+        buildNkroReport(state, chunk, reportBuffer[back]);
+    } else {
+#if REPORT_TABLE
+        memcpy(reportBuffer[back], reportTable[state], REPORT_SIZE);
+#else
+        buildReport(state, reportBuffer[back]);
+#endif
+    }
+
+    // Publish, a single byte store
+    reportFront = back;
+
+    reportArm();
+}
+
+// ----------------------------------------------------------------------------
+
+static void reportQueuePush(uchar state) {
+
+    // Nothing new to tell the host
+    if (state == reportQueueLast) {
+        return;
+    }
+
+    if ((uchar)(reportQueueHead - reportQueueTail) == REPORT_QUEUE_SIZE) {
+        // Full, fold into the newest entry so the final state still arrives.
+        // Folding back to the state before it drops the newest instead, two
+        // identical entries in a row would only repeat a report.
+        if (reportQueue[(reportQueueHead - 2) & REPORT_QUEUE_MASK] == state) {
+            reportQueueHead--;
+        } else {
+            reportQueue[(reportQueueHead - 1) & REPORT_QUEUE_MASK] = state;
+        }
+        if (status.reportOverflows != 0xFFFF) {
+            status.reportOverflows++;
+        }
+    } else {
+        reportQueue[reportQueueHead & REPORT_QUEUE_MASK] = state;
+        reportQueueHead++;
+    }
+
+    reportQueueLast = state;
+}
+
+// ----------------------------------------------------------------------------
+
+static void reportQueuePoll(void) {
+
+#if USB_COUNT_SOF
+    reportPickupPoll();
+#endif
+
+    // Only hand over a report once the previous one has been collected
+    if (!usbInterruptIsReady()) {
+        return;
+    }
+
+    if (reportMode == REPORT_MODE_NKRO) {
+
+        // Take the next state once every chunk of the last one went out,
+        // only chunks holding a changed key's usages need sending
+        if (!nkroPending && reportQueueTail != reportQueueHead) {
+            uchar state = reportQueue[reportQueueTail & REPORT_QUEUE_MASK];
+            uchar changed = state ^ nkroState;
+            reportQueueTail++;
+
+            for (uchar i = 0; i < NUM_KEYS; i++) {
+                if (changed & _BV(i)) {
+                    nkroPending |= nkroKeyChunks[i];
+                }
+            }
+            nkroState = state;
+            nkroPressing = (changed & state) != 0;
+        }
+
+        if (nkroPending) {
+            uchar others = nkroPending & ~_BV(NKRO_MOD_CHUNK);
+            uchar chunk = 0;
+
+            // Modifiers down before the usage they modify, up after it
+            if ((nkroPending & _BV(NKRO_MOD_CHUNK)) && (nkroPressing || !others)) {
+                chunk = NKRO_MOD_CHUNK;
+            } else {
+                while (!(others & _BV(chunk))) {
+                    chunk++;
+                }
+            }
+            nkroPending &= ~_BV(chunk);
+            usbSendScanCodes(nkroState, chunk);
+            idleCounter = 0;
+        }
+
+    } else if (reportQueueTail != reportQueueHead) {
+        usbSendScanCodes(reportQueue[reportQueueTail & REPORT_QUEUE_MASK], 0);
+        reportQueueTail++;
+        idleCounter = 0;
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+// Drop anything queued under the previous report mode and start over from
+// the current button state
+static void reportReset(void) {
+    reportMode      = settings.reportMode;
+    reportQueueTail = reportQueueHead;
+    reportQueueLast = 0;
+    nkroState       = 0;
+    nkroPending     = 0;
+
+    memset(reportBuffer, 0, sizeof(reportBuffer));
+
+    reportQueuePush(buttonState & ~profileHeld);
+}
+
+// ----------------------------------------------------------------------------
+
+// Apply settings that the host only learns about from descriptors
+static void configDescriptorUpdate(void) {
+    configDescriptor[CONFIG_DESCR_REPORT_LENGTH] = reportMode == REPORT_MODE_NKRO
+        ? NKRO_REPORT_DESCRIPTOR_LENGTH : USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH;
+    configDescriptor[CONFIG_DESCR_POLL_INTERVAL] = settings.pollInterval;
+}
+
+// ----------------------------------------------------------------------------
+
+// Recompute the CRC GET_KEY sends after the generation
+static void keyStoreCheck() {
+    uint16_t crc = 0xFFFF;
+    uchar *key = (uchar *)keyStore.keys;
+
+    for (uchar i = 0; i < sizeof(keyStore.keys); i++) {
+        crc = _crc16_update(crc, key[i]);
+    }
+    keyStore.crc = crc;
+}
+
+// ----------------------------------------------------------------------------
+
+// Make a change to keyStore.keys live
+static void keyStoreApply() {
+    keyStore.generation++;
+    keyStoreCheck();
+    buildReportTable();
+}
+
+// ----------------------------------------------------------------------------
+
+// Make a change to keyStore.keys live and part of the active profile, ready
+// to be saved
+static void keyStoreSeal() {
+    memcpy(keyProfiles[activeProfile], keyStore.keys, sizeof(keyStore.keys));
+    keyOverride = 0;
+    keyStoreApply();
+}
+
+// ----------------------------------------------------------------------------
+
+// Make another saved keymap live. A few dozen microseconds, no EEPROM.
+static void profileSelect(uchar profile) {
+    memcpy(keyStore.keys, keyProfiles[profile], sizeof(keyStore.keys));
+    activeProfile = profile;
+    keyOverride = 0;
+    keyStoreApply();
+}
+
+// ----------------------------------------------------------------------------
+
+static void updateDebounceMask() {
+    debounceEagerMask = 0;
+    memset(debounceWindow, 0, sizeof(debounceWindow));
+
+    for (uchar i = 0; i < NUM_KEYS; i++) {
+        if (debounceConfig[i].mode == DEBOUNCE_EAGER) {
+            debounceEagerMask |= _BV(i);
+        }
+
+        // Plane p holds bit p of every key's window
+        for (uchar p = 0; p < DEBOUNCE_BITS; p++) {
+            if (debounceConfig[i].window & _BV(p)) {
+                debounceWindow[p] |= _BV(i);
+            }
+        }
+    }
+}
+
+// ============================================================================
+// EEPROM RECORD STORE
+// ============================================================================
+
+// The whole configuration is saved as one record carrying a sequence number
+// and a CRC-8. Records are appended round robin over LOG_SLOTS slots, so each
+// EEPROM cell sees only a fraction of the writes, and at boot the newest
+// record whose CRC checks out wins. A record torn by a reset mid-write fails
+// its CRC and the one before it is used instead. Its sequence number is
+// written last, so until the record is complete the slot keeps the older
+// sequence of the record it replaces and cannot win even on a CRC collision.
+//
+// Records are written one byte per main loop pass, only starting a write once
+// the previous one has finished, so nothing ever waits on a 3.4 ms write.
+//
+//  |  0 - 31  |     32 - 71     |     72 - 111    | ... |
+//  |  Legacy  |   record_t #0   |   record_t #1   | ... |
+//
+// Bytes below LOG_START hold the original layout, OSCCAL at 0 and the keymap
+// at 12. They are read once, when no valid record exists, and never written
+// again, apart from the serial number that lives in the gap after OSCCAL.
+
+#define LEGACY_OSCCAL       0
+#define LEGACY_KEYS         12
+
+#define LOG_START           32
+#define LOG_SLOTS           ((EEPROM_SIZE - LOG_START) / sizeof(record_t))
+#define LOG_BLANK_SEQUENCE  0xFFFF              // Never used, erased EEPROM
+
+typedef struct {
+    uint16_t    sequence;                       // Newer records count up
+    uint8_t     osccal;
+    keymap_t    profiles[NUM_PROFILES][NUM_KEYS];
+    uint16_t    generation;
+    debounce_t  debounce[NUM_KEYS];
+    settings_t  settings;
+    uint8_t     crc;                            // CRC-8 of everything above
+} record_t;
+
+static uchar    osccalSaved;                    // Calibration kept in records
+static record_t persistRecord;                  // Newest record, or the one being written
+static uchar    persistDirty;                   // RAM differs from newest record
+static uchar    persistSlot;                    // Slot the next record goes to
+static uchar    persistOffset;                  // Bytes written, sizeof(record_t) when idle
+
+#define persistBusy()       (persistDirty || persistOffset < sizeof(record_t))
+
+// ----------------------------------------------------------------------------
+
+static uchar crc8(const uchar *data, uchar length) {
+    uchar crc = 0;
 
-    usbSetInterrupt(reportBuffer, sizeof(reportBuffer));
+    while (length--) {
+        crc = _crc8_ccitt_update(crc, *data++);
+    }
+
+    return crc;
+}
+
+// ----------------------------------------------------------------------------
+
+// Fill RAM from the layout used before the record log. It only held the
+// calibration and the keymap, the rest reads as blank and gets defaults.
+static void loadLegacy(void) {
+
+    osccalSaved = eeprom_read_byte((uchar *)LEGACY_OSCCAL);
+    eeprom_read_block(keyStore.keys, (const void *)LEGACY_KEYS, sizeof(keyStore.keys));
+    keyStore.generation = 0;
+
+    memset(debounceConfig, 0xFF, sizeof(debounceConfig));
+    memset(&settings, 0xFF, sizeof(settings));
 }
 
 // ----------------------------------------------------------------------------
 
-static void loadKeysFromEeprom() {
+// Find the newest valid record and load it, or fall back to the legacy
+// layout and queue a first record. Values EEPROM cannot have been meant to
+// hold, such as blank 0xFF bytes, are replaced by defaults.
+static void loadConfig(void) {
+    record_t record;
+    uchar found = 0;
 
-    // Wait for EEPROM activity to stop
     eeprom_busy_wait();
 
-    // Read stored values from EEPROM
-    eeprom_read_block((void *)&savedKeys,   // Pointer to save data
-        (const void *)SAVE_EEPROM_OFFSET,   // Location to read from
-        NUM_TOTAL_KEYS);                    // Length to read
-    
+    // Bounded scan, LOG_SLOTS reads of one record each
+    for (uchar slot = 0; slot < LOG_SLOTS; slot++) {
+        eeprom_read_block(&record,
+            (const void *)(LOG_START + slot * sizeof(record_t)),
+            sizeof(record_t));
+
+        if (record.sequence == LOG_BLANK_SEQUENCE
+                || record.crc != crc8((uchar *)&record, offsetof(record_t, crc))) {
+            continue;
+        }
+
+        if (!found || (int16_t)(record.sequence - persistRecord.sequence) > 0) {
+            persistRecord = record;
+            persistSlot = slot + 1;
+            found = 1;
+        }
+    }
+
+    persistOffset = sizeof(record_t);
+    persistDirty = 0;
+
+    if (found) {
+        osccalSaved = persistRecord.osccal;
+        memcpy(keyProfiles, persistRecord.profiles, sizeof(keyProfiles));
+        keyStore.generation = persistRecord.generation;
+        memcpy(debounceConfig, persistRecord.debounce, sizeof(debounceConfig));
+        settings = persistRecord.settings;
+
+        if (persistSlot >= LOG_SLOTS) {
+            persistSlot = 0;
+        }
+    } else {
+        // The old keymap becomes profile 0, the others start empty
+        loadLegacy();
+        memset(keyProfiles, 0, sizeof(keyProfiles));
+        memcpy(keyProfiles[0], keyStore.keys, sizeof(keyStore.keys));
+        persistRecord.sequence = 0;
+        persistSlot = 0;
+        persistDirty = 1;
+    }
+
     // If EEPROM byte reads 0xFF, assume empty memory and set to zero
+    uchar *key = (uchar *)keyProfiles;
+    for (uchar i = 0; i < sizeof(keyProfiles); i++) {
+        key[i] = (key[i] == 0xFF) ? 0 : key[i];
+    }
+
+    activeProfile = 0;
+    profileHeld = 0;
+    keyOverride = 0;
+    memcpy(keyStore.keys, keyProfiles[0], sizeof(keyStore.keys));
+    keyStoreCheck();
+
+    // Blank EEPROM reads 0xFF, fall back to the original eager 50 ms
     for (uchar i = 0; i < NUM_KEYS; i++) {
-        savedKeys[i].modifier = (savedKeys[i].modifier == 0xFF) ? 0 : savedKeys[i].modifier;
-        savedKeys[i].scancode = (savedKeys[i].scancode == 0xFF) ? 0 : savedKeys[i].scancode;
+        if (debounceConfig[i].window > DEBOUNCE_MAX_MS) {
+            debounceConfig[i].window = DEBOUNCE_DEFAULT_MS;
+        }
+        if (debounceConfig[i].mode != DEBOUNCE_DEFERRED) {
+            debounceConfig[i].mode = DEBOUNCE_EAGER;
+        }
+    }
+
+    if (settings.reportMode != REPORT_MODE_NKRO) {
+        settings.reportMode = REPORT_MODE_ARRAY;
+    }
+    if (settings.sofAlign != 1) {
+        settings.sofAlign = 0;
     }
+    if (settings.pollInterval == 0 || settings.pollInterval == 0xFF) {
+        settings.pollInterval = USB_CFG_INTR_POLL_INTERVAL;
+    }
+    if (settings.profileCombo >= _BV(NUM_KEYS)) {
+        settings.profileCombo = 0;
+    }
+
+    updateDebounceMask();
+    buildReportTable();
+}
+
+// ----------------------------------------------------------------------------
+
+static void persistMark(void) {
+    persistDirty = 1;
 }
 
 // ----------------------------------------------------------------------------
 
-static void saveKeysToEeprom() {
+static void persistPoll(void) {
+
+    if (eepromRestoring || !persistBusy() || !eeprom_is_ready()) {
+        return;
+    }
+
+    // Between records, snapshot RAM into the next one. Changes made while
+    // it is written mark RAM dirty again and go into the record after.
+    if (persistOffset >= sizeof(record_t)) {
+        persistDirty = 0;
+        persistOffset = 0;
+
+        persistRecord.sequence++;
+        if (persistRecord.sequence == LOG_BLANK_SEQUENCE) {
+            persistRecord.sequence = 0;
+        }
+        persistRecord.osccal = osccalSaved;
+        memcpy(persistRecord.profiles, keyProfiles, sizeof(keyProfiles));
+        persistRecord.generation = keyStore.generation;
+        memcpy(persistRecord.debounce, debounceConfig, sizeof(debounceConfig));
+        persistRecord.settings = settings;
+        persistRecord.crc = crc8((uchar *)&persistRecord, offsetof(record_t, crc));
+    }
+
+    // Body first, the sequence number last
+    uchar index     = (persistOffset + sizeof(persistRecord.sequence)) % sizeof(record_t);
+    uchar *address  = (uchar *)(LOG_START + persistSlot * sizeof(record_t) + index);
+    uchar value     = ((uchar *)&persistRecord)[index];
+
+    // Starts the write and returns, skip bytes that already match
+    if (eeprom_read_byte(address) != value) {
+        eeprom_write_byte(address, value);
+    }
+
+    if (++persistOffset >= sizeof(record_t)) {
+        persistSlot = (persistSlot + 1) % LOG_SLOTS;
+    }
+}
+
+// ============================================================================
+// SERIAL NUMBER
+// ============================================================================
+
+// Saved as up to SERIAL_MAX_LENGTH letters and digits, padded with 0xFF. It
+// changes once in a unit's life, so it is written directly instead of going
+// through the record log.
+
+static uchar serialValid(const uchar *serial, uchar length) {
+    if (length == 0 || length > SERIAL_MAX_LENGTH) {
+        return 0;
+    }
+    for (uchar i = 0; i < length; i++) {
+        uchar c = serial[i];
+        if (!((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// ----------------------------------------------------------------------------
+
+static void serialSet(const uchar *serial, uchar length) {
+    serialDescriptor[0] = USB_STRING_DESCRIPTOR_HEADER(length);
+    for (uchar i = 0; i < length; i++) {
+        serialDescriptor[1 + i] = serial[i];
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+static void serialLoad(void) {
+    static const uchar fallback[] = { USB_CFG_SERIAL_NUMBER };
+    uchar serial[SERIAL_MAX_LENGTH];
+    uchar length = 0;
+
     eeprom_busy_wait();
-    eeprom_update_block((void *)&savedKeys, // Pointer to data
-        (void *)SAVE_EEPROM_OFFSET,         // Location to update
-        NUM_TOTAL_KEYS);                    // Length to update
+    eeprom_read_block(serial, (const void *)SERIAL_EEPROM_OFFSET, sizeof(serial));
+
+    while (length < SERIAL_MAX_LENGTH && serial[length] != 0xFF) {
+        length++;
+    }
+
+    serialStored = serialValid(serial, length);
+    if (serialStored) {
+        serialSet(serial, length);
+    } else {
+        serialSet(fallback, sizeof(fallback));
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+// Write the serial in RAM to EEPROM, touching only bytes that differ. A unit
+// on the fallback serial keeps the bytes blank.
+static void serialStore(void) {
+    uchar length = serialStored ? (serialDescriptor[0] & 0xFF) / 2 - 1 : 0;
+
+    for (uchar i = 0; i < SERIAL_MAX_LENGTH; i++) {
+        eeprom_update_byte((uchar *)SERIAL_EEPROM_OFFSET + i,
+            i < length ? serialDescriptor[1 + i] : 0xFF);
+    }
 }
 
 // ============================================================================
@@ -162,6 +1016,44 @@ static void saveKeysToEeprom() {
 uchar clockHundredths;
 uchar clockMilliseconds;
 
+// ----------------------------------------------------------------------------
+// SAMPLE TIMER
+// ----------------------------------------------------------------------------
+
+// When enabled, Timer0 latches PINB at a fixed rate from a minimal interrupt
+// and the main loop debounces the queued samples. Otherwise the main loop
+// samples PINB itself whenever clockMilliseconds advances.
+
+#define SAMPLE_TIMER            1       // Sample inputs from Timer0 compare
+#define SAMPLE_RATE_HZ          1000    // Sample clock
+#define SAMPLE_TIMER_PRESCALE   256
+#define SAMPLE_TIMER_TOP        ((F_CPU / SAMPLE_TIMER_PRESCALE + SAMPLE_RATE_HZ / 2) / SAMPLE_RATE_HZ - 1)
+
+#define SAMPLE_RING_SIZE        8       // Must be a power of two
+#define SAMPLE_RING_MASK        (SAMPLE_RING_SIZE - 1)
+
+// With SETTING_SOF_ALIGN, Timer0 restarts from here on every SOF so that each
+// sample lands at the same point late in the USB frame. The SOF hook in
+// usbconfig.h loads it from the USB interrupt, so the phase does not depend
+// on how long the main loop takes; 0 leaves Timer0 free running.
+#define SAMPLE_ALIGN_START      (SAMPLE_TIMER_TOP / 4)
+
+#if SAMPLE_TIMER && (SAMPLE_TIMER_TOP < 1 || SAMPLE_TIMER_TOP > 255)
+#error "SAMPLE_RATE_HZ out of range for Timer0 with this prescaler"
+#endif
+
+#if SAMPLE_ALIGN_START == 0
+#error "SAMPLE_ALIGN_START must be non-zero, the SOF hook skips 0"
+#endif
+
+volatile uchar          sampleAlignStart;   // TCNT0 on SOF, read by USB_SOF_HOOK
+
+#if SAMPLE_TIMER
+static volatile uchar   sampleRing[SAMPLE_RING_SIZE];
+static volatile uchar   sampleHead;     // Written by ISR only
+static uchar            sampleTail;     // Written by main loop only
+#endif
+
 // ----------------------------------------------------------------------------
 
 static void timerInit(void) {
@@ -171,7 +1063,26 @@ static void timerInit(void) {
 
     // Synchronous clocking mode
     //PLLCSR &= ~_BV(PCKE);   // clear by default
+
+#if SAMPLE_TIMER
+    // Timer0 in CTC mode, prescale by 256, interrupt on compare match A
+    OCR0A  = SAMPLE_TIMER_TOP;
+    TCCR0A = _BV(WGM01);
+    TCCR0B = _BV(CS02);
+    TIMSK |= _BV(OCIE0A);
+#endif
+}
+
+// ----------------------------------------------------------------------------
+
+#if SAMPLE_TIMER
+// Keep this short and interruptible: the USB interrupt must never wait on it
+ISR(TIMER0_COMPA_vect, ISR_NOBLOCK) {
+    uchar head = sampleHead;
+    sampleRing[head & SAMPLE_RING_MASK] = IO_PINS;
+    sampleHead = head + 1;
 }
+#endif
 
 // ----------------------------------------------------------------------------
 
@@ -190,62 +1101,232 @@ static void timerPoll(void) {
     }
 }
 
+// ----------------------------------------------------------------------------
+
+// Repeat the last report every idle period set by the host, a rate of zero
+// means only report on change. The report is re-armed as is, never rebuilt.
+static void idlePoll(void) {
+    static uchar lastMillisecond;
+
+    while ((uchar)(clockMilliseconds - lastMillisecond) >= 4) {
+        lastMillisecond += 4;
+        if (idleCounter != 0xFF) {
+            idleCounter++;
+        }
+    }
+
+    if (idleRate && idleCounter >= idleRate
+            && reportQueueTail == reportQueueHead && usbInterruptIsReady()) {
+        if (reportMode == REPORT_MODE_NKRO) {
+            // Each chunk is its own report, repeat all of them
+            nkroPending |= nkroUsedChunks;
+        } else {
+            reportArm();
+        }
+        idleCounter = 0;
+    }
+}
+
 // ============================================================================
 // INPUT POLLING
 // ============================================================================
 
-static void buttonPoll(uchar key) {
+// All keys are debounced together from a single PINB sample per tick. Each
+// key has a vertical counter of the milliseconds left in its window: bit p of
+// every counter lives in debounceCount[p], so one pass over the DEBOUNCE_BITS
+// planes counts all keys down at once. A counter is preset from the planes in
+// debounceWindow and runs while any of its bits is set.
+//
+// Eager keys toggle on the first sample that disagrees with the debounced
+// state and then ignore the switch while their counter runs. Deferred keys
+// start their counter on the first disagreeing sample, drop it whenever the
+// sample agrees again, and toggle once it has run out. Cost per tick is the
+// same however many keys are busy.
+
+// Preset the counters of keys from their windows
+static void debounceLoad(uchar keys) {
+    for (uchar p = 0; p < DEBOUNCE_BITS; p++) {
+        debounceCount[p] = (debounceCount[p] & ~keys) | (debounceWindow[p] & keys);
+    }
+}
+
+static void buttonPoll(uchar sample) {
+
+    uchar running = 0;
+    for (uchar p = 0; p < DEBOUNCE_BITS; p++) {
+        running |= debounceCount[p];
+    }
+
+    // Eager keys ignore the switch until their window has elapsed
+    uchar delta = (sample ^ buttonState) & ~(running & debounceEagerMask);
 
-    static uchar debounceTimeIsOver;
-    static uchar debounceTimeout;
+    if (!(delta | running)) {
+        return;
+    }
 
-    uchar tempButtonValue = bit_is_clear(IO_PINS, SW[key]);
+    // Deferred keys that bounced back start over
+    uchar deferred = ~debounceEagerMask;
+    uchar bounced  = running & deferred & ~delta;
+    running &= ~bounced;
+
+    // Count every running key down by one, borrowing plane to plane
+    uchar borrow = running;
+    uchar left   = 0;
+    for (uchar p = 0; p < DEBOUNCE_BITS; p++) {
+        uchar plane = debounceCount[p] & ~bounced;
+        debounceCount[p] = plane ^ borrow;
+        borrow &= ~plane;
+        left |= debounceCount[p];
+    }
 
-    if (!debounceTimeIsOver) {
+    // A deferred level is accepted once its counter ran out, or at once
+    // with a zero window
+    uchar started  = delta & deferred & ~running;
+    uchar accepted = (delta & debounceEagerMask) | (running & deferred & ~left);
 
-        if (timeAfter(clockHundredths, debounceTimeout)) {
-            debounceTimeIsOver = 1;
+    if (started) {
+        debounceLoad(started);
+        for (uchar p = 0; p < DEBOUNCE_BITS; p++) {
+            started &= ~debounceWindow[p];
         }
+        accepted |= started;
+    }
 
-    } else {
+    if (accepted) {
+        buttonState   ^= accepted;
+        buttonChanged |= accepted;
+
+        // Hold eager keys for their window
+        debounceLoad(accepted & debounceEagerMask);
+    }
 
-        // Trigger a change if status has changed and the debounce-delay is over,
-        // this has good debounce rejection and latency but is subject to
-        // false trigger on electrical noise
+}
+
+// ----------------------------------------------------------------------------
+
+// Debounce one raw PINB sample and queue a report for any accepted edge, so
+// edges closer together than the host poll interval each get a report
+static void inputSample(uchar pins) {
 
-        if (tempButtonValue != buttonState[key]) {
-            buttonState[key] = tempButtonValue;
-            buttonStateChanged = 1;
+    buttonPoll(~pins & IO_SW_MASK);
 
-            // Restart debounce timer
-            debounceTimeIsOver = 0;
-            debounceTimeout = clockHundredths + 5;
+    if (buttonChanged) {
+        uchar combo = settings.profileCombo;
+
+        // Completing the combo moves to the next profile. Its keys are
+        // reported released and stay silent until let go.
+        profileHeld &= buttonState;
+        if (combo && (buttonChanged & combo) && (buttonState & combo) == combo
+                && !profileHeld) {
+            profileSelect((activeProfile + 1) % NUM_PROFILES);
+            profileHeld = combo;
         }
-    }
 
+        reportQueuePush(buttonState & ~profileHeld);
+        buttonChanged = 0;
+    }
 }
 
 // ============================================================================
 // USB DRIVER INTERFACE
 // ============================================================================
 
+// What this firmware supports, read by the host with STEPTOTALK_GET_CAPS so
+// it does not have to hard-code key counts or probe for requests. Bump the
+// protocol whenever an existing request changes meaning, together with the
+// minor number of USB_CFG_DEVICE_VERSION, which hosts key their caches on.
+// 2: WRITE_EEPROM only reloads configuration on EEPROM_WRITE_LAST.
+#define STEPTOTALK_PROTOCOL     2
+
+#define CAP_NKRO                _BV(0)          // SETTING_REPORT_MODE
+#define CAP_SOF_ALIGN           _BV(1)          // SETTING_SOF_ALIGN
+#define CAP_BULK_KEYS           _BV(2)          // SET_ALL_KEYS
+#define CAP_EEPROM_STREAM       _BV(3)          // READ_EEPROM, WRITE_EEPROM
+#define CAP_TRANSACTIONS        _BV(4)          // BEGIN_KEYS to ABORT_KEYS
+#define CAP_PROFILES            _BV(5)          // GET_PROFILE, SET_PROFILE
+#define CAP_VOLATILE_KEYS       _BV(6)          // SET_KEYS_VOLATILE, PERSIST_KEYS
+#define CAP_DEBOUNCE            _BV(7)          // GET_DEBOUNCE, SET_DEBOUNCE
+#define CAP_SERIAL              _BV(8)          // SET_SERIAL
+
+typedef struct {
+    uint8_t     protocol;                       // STEPTOTALK_PROTOCOL
+    uint8_t     numKeys;
+    uint8_t     numProfiles;
+    uint16_t    features;                       // CAP_* flags
+    uint16_t    eepromSize;
+    uint16_t    logStart;                       // First record slot
+    uint8_t     recordSize;
+    uint8_t     logSlots;
+    uint8_t     maxTransfer;                    // Largest EEPROM data stage
+    uint8_t     debounceMaxMs;
+} caps_t;
+
+static const caps_t caps = {
+    STEPTOTALK_PROTOCOL,
+    NUM_KEYS,
+    NUM_PROFILES,
+    CAP_NKRO | (SAMPLE_TIMER && USB_COUNT_SOF ? CAP_SOF_ALIGN : 0) | CAP_BULK_KEYS
+        | CAP_EEPROM_STREAM | CAP_TRANSACTIONS | CAP_PROFILES
+        | CAP_VOLATILE_KEYS | CAP_DEBOUNCE | CAP_SERIAL,
+    EEPROM_SIZE,
+    LOG_START,
+    sizeof(record_t),
+    LOG_SLOTS,
+    254,
+    DEBOUNCE_MAX_MS,
+};
+
+// ----------------------------------------------------------------------------
+
+// Take RAM copies back from EEPROM after it was written behind their back.
+// Unsaved changes lose to the restored image, the calibration of this unit
+// does not.
+static void eepromRestored(void) {
+    eepromRestoring = 0;
+    loadConfig();
+
+    if (osccalSaved != OSCCAL) {
+        osccalSaved = OSCCAL;
+        persistMark();
+    }
+
+    // An image from another unit must not clone its serial number, nor
+    // give one to a unit that had none
+    serialStore();
+}
+
+// ----------------------------------------------------------------------------
+
 uchar usbFunctionSetup(uchar data[8]) {
 
     usbRequest_t *rq    = (void *)data;
-    usbMsgPtr           = reportBuffer;
+    usbMsgPtr           = reportCommitted();
 
     // CLASS-SPECIFIC REQUEST -------------------------------------------------
     if((rq->bmRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_CLASS) {
 
         if(rq->bRequest == USBRQ_HID_GET_REPORT) {
+
+            if (reportMode == REPORT_MODE_NKRO) {
+                // Report ID in low byte of wValue
+                uchar chunk = rq->wValue.bytes[0] - 1;
+                if (chunk >= NKRO_CHUNKS) {
+                    chunk = 0;
+                }
+                buildNkroReport(nkroState, chunk, nkroGetReport);
+                usbMsgPtr = nkroGetReport;
+                return NKRO_REPORT_SIZE;
+            }
+
             // Only one report type
             // Don't need to look at wValue
-            return sizeof(reportBuffer);
+            return REPORT_SIZE;
         } else if(rq->bRequest == USBRQ_HID_GET_IDLE) {
             usbMsgPtr = &idleRate;
             return 1;
         } else if(rq->bRequest == USBRQ_HID_SET_IDLE) {
             idleRate = rq->wValue.bytes[1];
+            idleCounter = 0;
         }
 
     // VENDOR-SPECIFIC REQUEST ------------------------------------------------
@@ -253,22 +1334,234 @@ uchar usbFunctionSetup(uchar data[8]) {
 
         if(rq->bRequest == STEPTOTALK_GET_KEY) {
 
-            // Get key mapping
-            loadKeysFromEeprom(); 
-
-            // Send to host
-            usbMsgPtr = (usbMsgPtr_t)savedKeys;
-            return sizeof(savedKeys);
+            // Send keys, generation and CRC from RAM, EEPROM may still
+            // be catching up
+            usbMsgPtr = (usbMsgPtr_t)&keyStore;
+            return sizeof(keyStore);
 
         } else if(rq->bRequest == STEPTOTALK_SET_KEY) {
 
+            uchar key = rq->wIndex.bytes[0];
+
+            if (key >= NUM_KEYS) {
+                return 0;
+            }
+
             // Get key from request
-            savedKeys[rq->wIndex.bytes[0]].modifier = rq->wValue.bytes[0];
-            savedKeys[rq->wIndex.bytes[0]].scancode = rq->wValue.bytes[1];
+            keyStore.keys[key].modifier = rq->wValue.bytes[0];
+            keyStore.keys[key].scancode = rq->wValue.bytes[1];
+            keyStoreSeal();
+
+            // Save in the background
+            persistMark();
+            return 0;
+
+        } else if(rq->bRequest == STEPTOTALK_GET_CAPS) {
+
+            usbMsgPtr = (usbMsgPtr_t)&caps;
+            return sizeof(caps);
+
+        } else if(rq->bRequest == STEPTOTALK_GET_STATUS) {
+
+            // Send status counters to host
+#if USB_COUNT_SOF
+            status.sofCount = usbSofCount;
+#endif
+            status.persistPending = persistBusy();
+            usbMsgPtr = (usbMsgPtr_t)&status;
+            return sizeof(status);
+
+        } else if(rq->bRequest == STEPTOTALK_GET_SETTINGS) {
+
+            // Send stored settings to host
+            usbMsgPtr = (usbMsgPtr_t)&settings;
+            return sizeof(settings);
+
+        } else if(rq->bRequest == STEPTOTALK_SET_SETTING) {
+
+            // Setting in wIndex, value in low byte of wValue. Settings that
+            // shape descriptors take effect at the next enumeration.
+            uchar value = rq->wValue.bytes[0];
+
+            if (rq->wIndex.bytes[0] == SETTING_REPORT_MODE
+                    && value <= REPORT_MODE_NKRO) {
+                settings.reportMode = value;
+            } else if (rq->wIndex.bytes[0] == SETTING_SOF_ALIGN && value <= 1) {
+                settings.sofAlign = value;
+            } else if (rq->wIndex.bytes[0] == SETTING_POLL_INTERVAL
+                    && value != 0 && value != 0xFF) {
+                settings.pollInterval = value;
+            } else if (rq->wIndex.bytes[0] == SETTING_PROFILE_COMBO
+                    && value < _BV(NUM_KEYS)) {
+                settings.profileCombo = value;
+            } else {
+                return 0;
+            }
 
-            // Save
-            saveKeysToEeprom();
-            return sizeof(savedKeys);
+            persistMark();
+            return 0;
+
+        } else if(rq->bRequest == STEPTOTALK_GET_DEBOUNCE) {
+
+            // Send debounce configuration to host
+            usbMsgPtr = (usbMsgPtr_t)debounceConfig;
+            return sizeof(debounceConfig);
+
+        } else if(rq->bRequest == STEPTOTALK_SET_DEBOUNCE) {
+
+            uchar key = rq->wIndex.bytes[0];
+
+            // Ignore keys and windows the device cannot handle
+            if (key >= NUM_KEYS || rq->wValue.bytes[0] > DEBOUNCE_MAX_MS) {
+                return 0;
+            }
+
+            debounceConfig[key].window = rq->wValue.bytes[0];
+            debounceConfig[key].mode   = rq->wValue.bytes[1] == DEBOUNCE_DEFERRED
+                                            ? DEBOUNCE_DEFERRED : DEBOUNCE_EAGER;
+
+            // Restart this key's state machine under the new settings
+            updateDebounceMask();
+            for (uchar p = 0; p < DEBOUNCE_BITS; p++) {
+                debounceCount[p] &= ~_BV(key);
+            }
+
+            persistMark();
+            return 0;
+
+        } else if(rq->bRequest == STEPTOTALK_SET_ALL_KEYS
+                || rq->bRequest == STEPTOTALK_SET_KEYS_VOLATILE) {
+
+            // Whole keymap follows in the data stage, see usbFunctionWrite()
+            if (rq->wLength.word != NUM_TOTAL_KEYS) {
+                return 0;
+            }
+
+            writeRequest = rq->bRequest;
+            writeOffset  = 0;
+            writeLength  = NUM_TOTAL_KEYS;
+            return USB_NO_MSG;
+
+        } else if(rq->bRequest == STEPTOTALK_SET_SERIAL) {
+
+            // New serial follows in the data stage, used from the next
+            // enumeration
+            if (rq->wLength.word == 0 || rq->wLength.word > SERIAL_MAX_LENGTH) {
+                return 0;
+            }
+
+            writeRequest = rq->bRequest;
+            writeOffset  = 0;
+            writeLength  = rq->wLength.bytes[0];
+            return USB_NO_MSG;
+
+        } else if(rq->bRequest == STEPTOTALK_READ_EEPROM
+                || rq->bRequest == STEPTOTALK_WRITE_EEPROM) {
+
+            // Address in wIndex, up to 254 bytes in the data stage. Reads
+            // past the end come up short, writes past the end are refused.
+            // 255 would read back as USB_NO_MSG, so it is refused too.
+            eepromAddress   = rq->wIndex.word;
+            eepromRemaining = rq->wLength.bytes[0];
+
+            if (rq->wLength.bytes[1] || eepromRemaining >= USB_NO_MSG
+                    || eepromAddress > EEPROM_SIZE) {
+                return 0;
+            }
+
+            if (rq->bRequest == STEPTOTALK_WRITE_EEPROM) {
+                if (eepromRemaining > EEPROM_SIZE - eepromAddress) {
+                    return 0;
+                }
+                eepromRestoring = 1;
+                eepromWriteLast = rq->wValue.bytes[0] & EEPROM_WRITE_LAST;
+
+                // No data stage, only ends the restore
+                if (eepromRemaining == 0) {
+                    if (eepromWriteLast) {
+                        eepromRestored();
+                    }
+                    return 0;
+                }
+                writeRequest = rq->bRequest;
+            } else if (eepromRemaining > EEPROM_SIZE - eepromAddress) {
+                eepromRemaining = EEPROM_SIZE - eepromAddress;
+            }
+
+            return USB_NO_MSG;
+
+        } else if(rq->bRequest == STEPTOTALK_BEGIN_KEYS) {
+
+            // Start over from the live keymap, dropping anything staged
+            memcpy(stageKeys, keyStore.keys, sizeof(stageKeys));
+            stageGeneration = keyStore.generation;
+            stageState = STAGE_OPEN;
+            return 0;
+
+        } else if(rq->bRequest == STEPTOTALK_STAGE_KEY) {
+
+            uchar key = rq->wIndex.bytes[0];
+
+            if (stageState == STAGE_IDLE) {
+                return 0;
+            } else if (key >= NUM_KEYS) {
+                stageState = STAGE_FAILED;
+                return 0;
+            }
+
+            // Same encoding as SET_KEY
+            stageKeys[key].modifier = rq->wValue.bytes[0];
+            stageKeys[key].scancode = rq->wValue.bytes[1];
+            return 0;
+
+        } else if(rq->bRequest == STEPTOTALK_COMMIT_KEYS) {
+
+            stageCommitted = stageState == STAGE_OPEN
+                && stageGeneration == keyStore.generation;
+
+            // Reports are built in the main loop, which cannot run until
+            // this returns, so the whole map changes at once
+            if (stageCommitted) {
+                memcpy(keyStore.keys, stageKeys, sizeof(stageKeys));
+                keyStoreSeal();
+                persistMark();
+            }
+
+            stageState = STAGE_IDLE;
+            usbMsgPtr = &stageCommitted;
+            return 1;
+
+        } else if(rq->bRequest == STEPTOTALK_ABORT_KEYS) {
+
+            stageState = STAGE_IDLE;
+            return 0;
+
+        } else if(rq->bRequest == STEPTOTALK_GET_PROFILE) {
+
+            // Active profile and how many there are
+            static uchar profileInfo[2];
+            profileInfo[0] = activeProfile;
+            profileInfo[1] = NUM_PROFILES;
+            usbMsgPtr = profileInfo;
+            return sizeof(profileInfo);
+
+        } else if(rq->bRequest == STEPTOTALK_SET_PROFILE) {
+
+            // Profile in wIndex, not saved
+            if (rq->wIndex.bytes[0] < NUM_PROFILES) {
+                profileSelect(rq->wIndex.bytes[0]);
+            }
+            return 0;
+
+        } else if(rq->bRequest == STEPTOTALK_PERSIST_KEYS) {
+
+            // Keep the override, already live so the generation stands
+            if (keyOverride) {
+                memcpy(keyProfiles[activeProfile], keyStore.keys, sizeof(keyStore.keys));
+                keyOverride = 0;
+                persistMark();
+            }
+            return 0;
 
         } else {
             // Not understood
@@ -284,14 +1577,142 @@ uchar usbFunctionSetup(uchar data[8]) {
 
 // ----------------------------------------------------------------------------
 
+// Called for each packet of a control-IN request that returned USB_NO_MSG,
+// a short packet ends the transfer
+uchar usbFunctionRead(uchar *data, uchar len) {
+
+    if (len > eepromRemaining) {
+        len = eepromRemaining;
+    }
+
+    eeprom_busy_wait();
+    eeprom_read_block(data, (const void *)eepromAddress, len);
+    eepromAddress   += len;
+    eepromRemaining -= len;
+
+    return len;
+}
+
+// ----------------------------------------------------------------------------
+
+// Called for each data packet of a request that returned USB_NO_MSG. Returns
+// 1 once the last byte has arrived and been applied.
+uchar usbFunctionWrite(uchar *data, uchar len) {
+
+    if (writeRequest == STEPTOTALK_WRITE_EEPROM) {
+
+        if (len > eepromRemaining) {
+            len = eepromRemaining;
+        }
+
+        // Restores are rare, simply wait out each byte that differs
+        for (uchar i = 0; i < len; i++) {
+            eeprom_update_byte((uchar *)eepromAddress++, data[i]);
+        }
+        eepromRemaining -= len;
+
+        if (eepromRemaining) {
+            return 0;
+        }
+
+        if (eepromWriteLast) {
+            eepromRestored();
+        }
+        return 1;
+    }
+
+    if (len > writeLength - writeOffset) {
+        len = writeLength - writeOffset;
+    }
+
+    memcpy(writeBuffer + writeOffset, data, len);
+    writeOffset += len;
+
+    if (writeOffset < writeLength) {
+        return 0;
+    }
+
+    if (writeRequest == STEPTOTALK_SET_ALL_KEYS) {
+
+        // One generation and one EEPROM pass for the whole map
+        memcpy(keyStore.keys, writeBuffer, NUM_TOTAL_KEYS);
+        keyStoreSeal();
+
+        persistMark();
+
+    } else if (writeRequest == STEPTOTALK_SET_KEYS_VOLATILE) {
+
+        // Live at once, nothing written
+        memcpy(keyStore.keys, writeBuffer, NUM_TOTAL_KEYS);
+        keyStoreApply();
+        keyOverride = 1;
+
+    } else if (writeRequest == STEPTOTALK_SET_SERIAL) {
+
+        if (serialValid(writeBuffer, writeLength)) {
+            serialSet(writeBuffer, writeLength);
+            serialStored = 1;
+            serialStore();
+        }
+    }
+
+    return 1;
+}
+
+// ----------------------------------------------------------------------------
+
+usbMsgLen_t usbFunctionDescriptor(struct usbRequest *rq) {
+
+    if (rq->wValue.bytes[1] == USBDESCR_CONFIG) {
+        usbMsgPtr = configDescriptor;
+        return sizeof(configDescriptor);
+    } else if (rq->wValue.bytes[1] == USBDESCR_HID) {
+        usbMsgPtr = configDescriptor + CONFIG_DESCR_HID_OFFSET;
+        return 9;
+    } else if (rq->wValue.bytes[1] == USBDESCR_HID_REPORT) {
+        // Report descriptors live in flash, see usbconfig.h
+        if (reportMode == REPORT_MODE_NKRO) {
+            usbMsgPtr = (usbMsgPtr_t)nkroReportDescriptor;
+            return sizeof(nkroReportDescriptor);
+        }
+        usbMsgPtr = (usbMsgPtr_t)usbDescriptorHidReport;
+        return USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH;
+    } else if (rq->wValue.bytes[1] == USBDESCR_STRING) {
+        // Only the serial number is dynamic
+        usbMsgPtr = (usbMsgPtr_t)serialDescriptor;
+        return serialDescriptor[0] & 0xFF;
+    }
+
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+
 void hadUsbReset(void) {
     cli();
     calibrateOscillator();
     sei();
 
-    // Store the calibrated value in EEPROM if it has changed
-    if (eeprom_read_byte(0) != OSCCAL)
-        eeprom_write_byte(0, OSCCAL);
+    // A restore that never finished, take what reached EEPROM
+    if (eepromRestoring) {
+        eepromRestored();
+    }
+
+    // Save the calibrated value if it has changed
+    if (osccalSaved != OSCCAL) {
+        osccalSaved = OSCCAL;
+        persistMark();
+    }
+
+    // Whoever was programming the device is gone
+    stageState = STAGE_IDLE;
+    if (keyOverride) {
+        profileSelect(activeProfile);
+    }
+
+    // The host is about to read descriptors, apply stored settings now
+    reportReset();
+    configDescriptorUpdate();
 }
 
 // ============================================================================
@@ -300,14 +1721,17 @@ void hadUsbReset(void) {
 
 int main(void) {
     uchar i;
-    uchar calibrationValue;
+#if !SAMPLE_TIMER
+    uchar lastSample = 0;
+#endif
 
     // USB SETUP --------------------------------------------------------------
 
-    // Get calibration value from last time
-    calibrationValue = eeprom_read_byte(0);
-    if(calibrationValue != 0xff){
-        OSCCAL = calibrationValue;
+    // Get configuration and calibration value from last time
+    loadConfig();
+    serialLoad();
+    if(osccalSaved != 0xff){
+        OSCCAL = osccalSaved;
     }
 
     usbInit();
@@ -330,14 +1754,15 @@ int main(void) {
 
     // Configure Pull-Ups
     IO_PORT = 0;                                        // Clear all pull-ups
-    IO_PORT = _BV(SW[0]) | _BV(SW[1]) | _BV(SW[2]);     // Set switch pull-ups
+    IO_PORT = IO_SW_MASK;                               // Set switch pull-ups
 
     timerInit();
     sei();
 
     // KEY SETUP --------------------------------------------------------------
     
-    loadKeysFromEeprom();
+    reportReset();
+    configDescriptorUpdate();
 
     // MAIN LOOP --------------------------------------------------------------
 
@@ -346,42 +1771,39 @@ int main(void) {
         // Do all polls
         wdt_reset();
         usbPoll();
-        buttonPoll(0);
-        buttonPoll(1);
-        buttonPoll(2);
         timerPoll();
 
-        // If a button change is detected, send appropriate scan code
-        if (buttonStateChanged) {
-
-            // Temporary
-            uchar keyOut[NUM_KEYS] = {0};
-            uchar modOut = 0;
-
-            for (uchar i = 0; i < NUM_KEYS; i++) {
-
-                if (buttonState[i]) {
-                    // Press
-                    keyOut[i] = savedKeys[i].scancode;
-
-                    if (savedKeys[i].modifier != MOD_NONE) {
-                        modOut |= savedKeys[i].modifier;
-                    }
-                } else {
-                    // Release, but only if a key was specified
-                    if (savedKeys[i].scancode == 0) {
-                        keyOut[i] = 0;
-                    } else {
-                        keyOut[i] = 0x80 | savedKeys[i].scancode;
-                    }
-                }
-            }
+#if SAMPLE_TIMER && USB_COUNT_SOF
+        // Phase-lock the sample clock to the USB frame clock, the SOF hook
+        // does the restart
+        sampleAlignStart = settings.sofAlign ? SAMPLE_ALIGN_START : 0;
+#endif
+
+#if SAMPLE_TIMER
+        // Debounce every sample latched since the last pass, if we fell
+        // behind by more than the ring holds, skip to the oldest kept one
+        uchar head = sampleHead;
+        if ((uchar)(head - sampleTail) > SAMPLE_RING_SIZE) {
+            sampleTail = head - SAMPLE_RING_SIZE;
+        }
+        while (sampleTail != head) {
+            inputSample(sampleRing[sampleTail & SAMPLE_RING_MASK]);
+            sampleTail++;
+        }
+#else
+        // Sample all switches once per millisecond, pressed reads low
+        if (clockMilliseconds != lastSample) {
+            lastSample = clockMilliseconds;
+            inputSample(IO_PINS);
+        }
+#endif
 
-            usbSendScanCode(modOut, keyOut);
+        // Hand the next queued report to the driver
+        reportQueuePoll();
+        idlePoll();
 
-            // Reset debounce
-            buttonStateChanged = 0;
-        }
+        // Write at most one EEPROM byte per pass
+        persistPoll();
 
     }
 
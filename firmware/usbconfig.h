@@ -115,6 +115,10 @@ section at the end of this file).
  * interval. The value is in milliseconds and must not be less than 10 ms for
  * low speed devices.
  */
+/* Step-to-Talk only uses this as the default for the poll interval stored in
+ * EEPROM, which main.c patches into its configuration descriptor at every
+ * USB reset. Most hosts honor shorter intervals even for low speed devices.
+ */
 #define USB_CFG_IS_SELF_POWERED         0
 /* Define this to 1 if the device has its own power supply. Set it to 0 if the
  * device is powered from the USB bus.
@@ -124,12 +128,12 @@ section at the end of this file).
  * The value is in milliamperes. [It will be divided by two since USB
  * communicates power requirements in units of 2 mA.]
  */
-#define USB_CFG_IMPLEMENT_FN_WRITE      0
+#define USB_CFG_IMPLEMENT_FN_WRITE      1
 /* Set this to 1 if you want usbFunctionWrite() to be called for control-out
  * transfers. Set it to 0 if you don't need it and want to save a couple of
  * bytes.
  */
-#define USB_CFG_IMPLEMENT_FN_READ       0
+#define USB_CFG_IMPLEMENT_FN_READ       1
 /* Set this to 1 if you need to send control replies which are generated
  * "on the fly" when usbFunctionRead() is called. If you only want to send
  * data from a static buffer, set it to 0 and return the data from
@@ -172,11 +176,25 @@ section at the end of this file).
 /* This macro (if defined) is executed when a USB SET_ADDRESS request was
  * received.
  */
-#define USB_COUNT_SOF                   0
+#define USB_COUNT_SOF                   1
 /* define this macro to 1 if you need the global variable "usbSofCount" which
  * counts SOF packets. This feature requires that the hardware interrupt is
  * connected to D- instead of D+.
  */
+#ifdef __ASSEMBLER__
+macro sofAlignHook
+    lds     YL, sampleAlignStart
+    tst     YL
+    breq    1f
+    out     _SFR_IO_ADDR(TCNT0), YL
+1:
+    endm
+#endif
+#define USB_SOF_HOOK                    sofAlignHook
+/* Restart the sample timer (Timer0) at a fixed point in every frame while
+ * main.c sets sampleAlignStart, see SETTING_SOF_ALIGN. Five cycles, and
+ * only on the SOF path, where no data packet follows.
+ */
 /* #ifdef __ASSEMBLER__
  * macro myAssemblerMacro
  *     in      YL, TCNT0
@@ -239,8 +257,10 @@ section at the end of this file).
  * with libusb: 0x16c0/0x5dc.  Use this VID/PID pair ONLY if you understand
  * the implications!
  */
-#define USB_CFG_DEVICE_VERSION  0x00, 0x01
+#define USB_CFG_DEVICE_VERSION  0x02, 0x01
 /* Version number of the device: Minor number first, then major number.
+ * The minor number is STEPTOTALK_PROTOCOL in main.c, bump them together.
+ * 1.0 is firmware from before GET_CAPS.
  */
 #define USB_CFG_VENDOR_NAME     'Y', 'e', 'l', 'l', 'o', 'w', 'L', 'e', 'a', 'f', '.', 't', 'e', 'c', 'h'
 #define USB_CFG_VENDOR_NAME_LEN 15
@@ -262,6 +282,8 @@ section at the end of this file).
 #define USB_CFG_SERIAL_NUMBER_LEN   5
 /* Same as above for the serial number. If you don't want a serial number,
  * undefine the macros.
+ * Step-to-Talk serves the serial from EEPROM, see USB_CFG_DESCR_PROPS_STRING_
+ * SERIAL_NUMBER below. This one is only used by units without a serial set.
  * It may be useful to provide the serial number through other means than at
  * compile time. See the section about descriptor properties below for how
  * to fine tune control over USB descriptors such as the string descriptor
@@ -286,6 +308,10 @@ section at the end of this file).
  * "usbHidReportDescriptor" to your code which contains the report descriptor.
  * Don't forget to keep the array and this define in sync!
  */
+/* This is the length of the array-mode descriptor. main.c serves the
+ * configuration, HID and report descriptors itself so that the NKRO report
+ * mode can swap in its own report descriptor at enumeration.
+ */
 
 /* #define USB_PUBLIC static */
 /* Use the define above if you #include usbdrv.c instead of linking against it.
@@ -345,14 +371,14 @@ section at the end of this file).
  */
 
 #define USB_CFG_DESCR_PROPS_DEVICE                  0
-#define USB_CFG_DESCR_PROPS_CONFIGURATION           0
+#define USB_CFG_DESCR_PROPS_CONFIGURATION           (USB_PROP_IS_DYNAMIC | USB_PROP_IS_RAM)
 #define USB_CFG_DESCR_PROPS_STRINGS                 0
 #define USB_CFG_DESCR_PROPS_STRING_0                0
 #define USB_CFG_DESCR_PROPS_STRING_VENDOR           0
 #define USB_CFG_DESCR_PROPS_STRING_PRODUCT          0
-#define USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER    0
-#define USB_CFG_DESCR_PROPS_HID                     0
-#define USB_CFG_DESCR_PROPS_HID_REPORT              0
+#define USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER    (USB_PROP_IS_DYNAMIC | USB_PROP_IS_RAM)
+#define USB_CFG_DESCR_PROPS_HID                     (USB_PROP_IS_DYNAMIC | USB_PROP_IS_RAM)
+#define USB_CFG_DESCR_PROPS_HID_REPORT              USB_PROP_IS_DYNAMIC
 #define USB_CFG_DESCR_PROPS_UNKNOWN                 0
 
 /* ----------------------- Optional MCU Description ------------------------ */